@@ -32,347 +32,3537 @@
 #include <ns3/propagation-delay-model.h>
 #include <ns3/simulator.h>
 #include <ns3/single-model-spectrum-channel.h>
+#include <ns3/spectrum-phy.h>
+#include <ns3/spectrum-value.h>
+#include <ns3/net-device.h>
 #include <ns3/constant-position-mobility-model.h>
 #include <ns3/packet.h>
+#include <ns3/header.h>
+#include <ns3/tag.h>
 #include <ns3/buildings-module.h>
+#include <ns3/system-wall-clock-ms.h>
 // #include "ns3/error-model.h"
 
 #include <iostream>
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <cstdio>
+#include <cstddef>
+#include <cmath>
+#include <limits>
+#include <deque>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <chrono>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wsan-trace.h"
+#include "wsan-cosim.h"
+#include "wsan-scenario.h"
+#include "wsan-frame.h"
+
+#ifdef WSAN_PROFILE
+#include <ns3/scheduler.h>
+#include <ns3/map-scheduler.h>
+#include <cxxabi.h>
+#include <typeinfo>
+#include <typeindex>
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+using namespace ns3;
+
+// CLASS SPACE =================================================================
+#ifdef WSAN_PROFILE
+// Hot-path profiler, compiled in with -DWSAN_PROFILE
+// (CXXFLAGS="-DWSAN_PROFILE" ./waf configure). ProfilingScheduler opens a
+// root frame for every event, named after its type; PROFILE_SCOPE frames
+// nest below it. Frames are timed with the cycle counter and charged to
+// their call stack, which is also how the folded flame-graph output is
+// keyed. Queue depth and pending events per node (event context) are
+// sampled as the simulation clock passes each sampling interval.
+inline uint64_t ProfileCycles () {
+#if defined (__x86_64__) || defined (__i386__)
+  return __rdtsc ();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+#endif
+}
+
+class Profiler {
+public:
+  static Profiler& Get () {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  uint32_t Site (std::string name, bool event = false) {
+    SiteStats s;
+    s.name = name;
+    s.event = event;
+    sites.push_back (s);
+    return sites.size () - 1;
+  }
+
+  void Enter (uint32_t site) {
+    uint32_t parent = stack.empty () ? 0 : stack.back ().node;
+    uint64_t key = (static_cast<uint64_t>(parent) << 32) | site;
+    std::unordered_map<uint64_t, uint32_t>::iterator it = children.find (key);
+    uint32_t node = tree.size ();
+    if (it == children.end ()) {
+      TreeNode n = {parent, site, 0};
+      tree.push_back (n);
+      children[key] = node;
+    } else {
+      node = it->second;
+    }
+    Frame f = {node, ProfileCycles (), 0};
+    stack.push_back (f);
+  }
+
+  void Exit () {
+    Frame f = stack.back ();
+    stack.pop_back ();
+    uint64_t total = ProfileCycles () - f.start;
+    TreeNode &n = tree[f.node];
+    n.self += total - f.child;
+    SiteStats &s = sites[n.site];
+    s.calls++;
+    s.self += total - f.child;
+    s.total += total;
+    if (!stack.empty ()) {
+      stack.back ().child += total;
+    }
+  }
+
+  // an event runs until the scheduler hands out the next one
+  void BeginEvent (const std::type_info &type) {
+    EndEvent ();
+    std::unordered_map<std::type_index, uint32_t>::iterator it = eventSites.find (type);
+    uint32_t site = it != eventSites.end () ? it->second : (eventSites[type] = Site (EventName (type), true));
+    Enter (site);
+  }
+
+  void EndEvent () {
+    while (!stack.empty ()) {
+      Exit ();
+    }
+  }
+
+  void QueueInsert (uint32_t context) {
+    depth++;
+    if (context < MAX_NODE_CONTEXT) {
+      if (context >= pending.size ()) {
+        pending.resize (context + 1, 0);
+      }
+      pending[context]++;
+    }
+  }
+
+  void QueueRemove (uint32_t context) {
+    depth--;
+    if (context < pending.size ()) {
+      pending[context]--;
+    }
+  }
+
+  // the simulation clock reached ts
+  void Advance (int64_t ts) {
+    if (ts >= nextSampleTs) {
+      Sample (ts);
+    }
+  }
+
+  void Start (int64_t sampleInterval) {
+    interval = std::max<int64_t> (sampleInterval, 1);
+    nextSampleTs = 0;
+    startCycles = ProfileCycles ();
+    startWall = std::chrono::steady_clock::now ();
+  }
+
+  void Report (std::string file) {
+    EndEvent ();
+    double us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now () - startWall).count ();
+    double ticksPerUs = us > 0 ? (ProfileCycles () - startCycles) / us : 1;
+
+    std::vector<uint32_t> order (sites.size ());
+    uint64_t allSelf = 0;
+    for (size_t i = 0; i < sites.size (); i++) {
+      order[i] = i;
+      allSelf += sites[i].self;
+    }
+    std::sort (order.begin (), order.end (), [this] (uint32_t a, uint32_t b) { return sites[a].self > sites[b].self; });
+    std::cout << "profile (" << ticksPerUs << " ticks/us):" << std::endl
+              << "   self%     self ms    total ms       calls  ns/call  site" << std::endl;
+    for (size_t i = 0; i < order.size () && i < 30; i++) {
+      const SiteStats &s = sites[order[i]];
+      std::cout << std::fixed << std::setprecision (2) << std::setw (8) << (allSelf ? 100.0 * s.self / allSelf : 0)
+                << std::setw (12) << s.self / ticksPerUs / 1000 << std::setw (12) << s.total / ticksPerUs / 1000
+                << std::setw (12) << s.calls << std::setw (9) << std::setprecision (0)
+                << (s.calls ? s.total / ticksPerUs * 1000 / s.calls : 0) << "  " << (s.event ? "[event] " : "")
+                << s.name << std::endl;
+    }
+    std::cout.unsetf (std::ios::floatfield);
+    std::cout << std::setprecision (6);
+
+    std::vector<uint32_t> busiest;
+    for (uint32_t n = 0; n < pendingSum.size (); n++) {
+      busiest.push_back (n);
+    }
+    std::sort (busiest.begin (), busiest.end (), [this] (uint32_t a, uint32_t b) { return pendingSum[a] > pendingSum[b]; });
+    std::cout << "event queue: " << samples.size () << " samples, depth max " << maxDepth << " mean "
+              << (samples.empty () ? 0 : depthSum / samples.size ()) << "; most pending:";
+    for (size_t i = 0; i < busiest.size () && i < 5 && pendingSum[busiest[i]] > 0; i++) {
+      std::cout << " node " << busiest[i] << " (mean " << pendingSum[busiest[i]] / samples.size ()
+                << " max " << pendingMax[busiest[i]] << ")";
+    }
+    std::cout << std::endl;
+
+    if (file.empty ()) {
+      return;
+    }
+    // flamegraph.pl input: "root;child;leaf self-ticks"
+    std::ofstream folded ((file + ".folded").c_str ());
+    for (uint32_t n = 1; n < tree.size (); n++) {
+      if (tree[n].self == 0) {
+        continue;
+      }
+      std::string path = sites[tree[n].site].name;
+      for (uint32_t p = tree[n].parent; p != 0; p = tree[p].parent) {
+        path = sites[tree[p].site].name + ";" + path;
+      }
+      folded << path << " " << tree[n].self << "\n";
+    }
+    std::ofstream queue ((file + ".queue.csv").c_str ());
+    queue << "time_s,depth,nodes_pending,busiest_node,busiest_pending\n";
+    for (size_t i = 0; i < samples.size (); i++) {
+      const QueueSample &q = samples[i];
+      queue << q.ts * 1e-9 << "," << q.depth << "," << q.nodes << "," << q.busiest << "," << q.busiestPending << "\n";
+    }
+  }
+
+private:
+  static const uint32_t MAX_NODE_CONTEXT = 0x10000;  // above: Simulator::NO_CONTEXT
+
+  struct SiteStats {
+    std::string name;
+    bool event;
+    uint64_t calls = 0;
+    uint64_t self = 0;   // (ticks)
+    uint64_t total = 0;  // (ticks) including nested frames
+  };
+  struct TreeNode {
+    uint32_t parent;
+    uint32_t site;
+    uint64_t self;
+  };
+  struct Frame {
+    uint32_t node;
+    uint64_t start;
+    uint64_t child;
+  };
+  struct QueueSample {
+    int64_t ts;
+    uint64_t depth;
+    uint32_t nodes;
+    uint32_t busiest;
+    uint32_t busiestPending;
+  };
+
+  Profiler () : depth (0), interval (1), nextSampleTs (0), maxDepth (0), depthSum (0), startCycles (0) {
+    TreeNode root = {0, 0, 0};
+    tree.push_back (root);
+  }
+
+  void Sample (int64_t ts) {
+    QueueSample q = {ts, depth, 0, 0, 0};
+    pendingSum.resize (pending.size (), 0);
+    pendingMax.resize (pending.size (), 0);
+    for (uint32_t n = 0; n < pending.size (); n++) {
+      q.nodes += pending[n] > 0;
+      if (pending[n] > q.busiestPending) {
+        q.busiest = n;
+        q.busiestPending = pending[n];
+      }
+      pendingSum[n] += pending[n];
+      pendingMax[n] = std::max (pendingMax[n], pending[n]);
+    }
+    samples.push_back (q);
+    maxDepth = std::max (maxDepth, depth);
+    depthSum += depth;
+    nextSampleTs = (ts / interval + 1) * interval;
+  }
+
+  // "ns3::MakeEvent<void (ns3::LrWpanPhy::*)(), ns3::Ptr<ns3::LrWpanPhy> >(...)::EventMemberImpl0"
+  // becomes "void (LrWpanPhy::*)(), Ptr<LrWpanPhy>"
+  static std::string EventName (const std::type_info &type) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle (type.name (), 0, 0, &status);
+    std::string name = status == 0 ? demangled : type.name ();
+    free (demangled);
+    size_t begin = name.find ("MakeEvent<");
+    if (begin != std::string::npos) {
+      begin += 10;
+      size_t end = begin;
+      for (int nesting = 1; end < name.size () && nesting > 0; end++) {
+        nesting += name[end] == '<' ? 1 : name[end] == '>' ? -1 : 0;
+      }
+      name = name.substr (begin, end - 1 - begin);
+    }
+    for (size_t p = name.find ("ns3::"); p != std::string::npos; p = name.find ("ns3::")) {
+      name.erase (p, 5);
+    }
+    return name;
+  }
+
+  std::vector<SiteStats> sites;
+  std::vector<TreeNode> tree;          // call tree, [0] is the root
+  std::unordered_map<uint64_t, uint32_t> children;  // parent << 32 | site -> tree node
+  std::unordered_map<std::type_index, uint32_t> eventSites;
+  std::vector<Frame> stack;
+
+  uint64_t depth;                      // events in the queue
+  std::vector<uint32_t> pending;       // per node (context)
+  int64_t interval;
+  int64_t nextSampleTs;
+  std::vector<QueueSample> samples;
+  std::vector<double> pendingSum;
+  std::vector<uint32_t> pendingMax;
+  uint64_t maxDepth;
+  double depthSum;
+
+  uint64_t startCycles;
+  std::chrono::steady_clock::time_point startWall;
+};
+
+class ProfileScope {
+public:
+  ProfileScope (uint32_t site) {
+    Profiler::Get ().Enter (site);
+  }
+  ~ProfileScope () {
+    Profiler::Get ().Exit ();
+  }
+};
+
+// Map scheduler that reports every queue operation to the profiler.
+class ProfilingScheduler : public Scheduler {
+public:
+  static TypeId GetTypeId () {
+    static TypeId tid = TypeId ("ProfilingScheduler")
+      .SetParent<Scheduler> ()
+      .AddConstructor<ProfilingScheduler> ();
+    return tid;
+  }
+
+  ProfilingScheduler () : inner (CreateObject<MapScheduler> ()) {}
+
+  void Insert (const Event &ev) {
+    inner->Insert (ev);
+    Profiler::Get ().QueueInsert (ev.key.m_context);
+  }
+
+  bool IsEmpty () const {
+    return inner->IsEmpty ();
+  }
+
+  Event PeekNext () const {
+    return inner->PeekNext ();
+  }
+
+  Event RemoveNext () {
+    Event ev = inner->RemoveNext ();
+    Profiler::Get ().QueueRemove (ev.key.m_context);
+    Profiler::Get ().Advance (ev.key.m_ts);
+    Profiler::Get ().BeginEvent (typeid (*ev.impl));
+    return ev;
+  }
+
+  void Remove (const Event &ev) {
+    inner->Remove (ev);
+    Profiler::Get ().QueueRemove (ev.key.m_context);
+  }
+
+private:
+  Ptr<Scheduler> inner;
+};
+
+#define PROFILE_SCOPE(name) \
+  static const uint32_t profileSite = Profiler::Get ().Site (name); \
+  ProfileScope profileScope (profileSite)
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
+// On-air frame body. Fields are written explicitly in network byte order (the
+// layout after the route is FrameCodec's), so the encoding does not depend
+// on the compiler's struct layout or padding.
+// Receivers PeekHeader () it into a stack object; nothing is heap allocated.
+class PacketStructure : public Header {
+public:
+  SourceRoute SRN;        // 1+n bytes: set of path field
+  uint16_t dest_idx = 0;  // 2 bytes: destination index (before: direction)
+  uint8_t seq       = 0;  // 1 byte : sequence
+  double payload    = 0;  // 8 bytes: payload (IEEE 754 bit pattern)
+
+  PacketStructure () {}
+  PacketStructure (const SourceRoute &_SRN, uint16_t _dest_idx, uint8_t _seq, double _payload)
+    : SRN (_SRN), dest_idx (_dest_idx), seq (_seq), payload (_payload) {}
+
+  uint32_t GetDsn () const {
+    return (static_cast<uint32_t>(dest_idx) << 8) | seq;
+  }
+
+  static TypeId GetTypeId () {
+    static TypeId tid = TypeId ("PacketStructure")
+      .SetParent<Header> ()
+      .AddConstructor<PacketStructure> ();
+    return tid;
+  }
+
+  virtual TypeId GetInstanceTypeId () const {
+    return GetTypeId ();
+  }
+
+  virtual uint32_t GetSerializedSize () const {
+    return SRN.GetSerializedSize () + FrameCodec::Get ().GetSerializedSize ();
+  }
+
+  virtual void Serialize (Buffer::Iterator start) const {
+    SRN.Serialize (start);
+    FrameCodec::Get ().Write (start, dest_idx, seq, payload);
+  }
+
+  virtual uint32_t Deserialize (Buffer::Iterator start) {
+    SRN.Deserialize (start);
+    FrameCodec::Get ().Read (start, dest_idx, seq, payload);
+    return GetSerializedSize ();
+  }
+
+  virtual void Print (std::ostream &os) const {
+    os << "SRN=";
+    SRN.Print (os);
+    os << " dest=" << dest_idx
+       << " seq=" << static_cast<int>(seq) << " payload=" << payload;
+  }
+};
+
+// Header of an aggregated frame: a marker no PacketStructure starts with (its
+// first byte is a route length <= 64, optionally with the 0x80 list flag) and
+// the number of samples that follow, each a complete PacketStructure.
+class AggregateHeader : public Header {
+public:
+  static const uint8_t MARKER = 0x7f;
+  uint8_t count = 0;
+
+  static TypeId GetTypeId () {
+    static TypeId tid = TypeId ("AggregateHeader")
+      .SetParent<Header> ()
+      .AddConstructor<AggregateHeader> ();
+    return tid;
+  }
+
+  virtual TypeId GetInstanceTypeId () const {
+    return GetTypeId ();
+  }
+
+  virtual uint32_t GetSerializedSize () const {
+    return 2;
+  }
+
+  virtual void Serialize (Buffer::Iterator start) const {
+    start.WriteU8 (MARKER);
+    start.WriteU8 (count);
+  }
+
+  virtual uint32_t Deserialize (Buffer::Iterator start) {
+    start.ReadU8 ();
+    count = start.ReadU8 ();
+    return GetSerializedSize ();
+  }
+
+  virtual void Print (std::ostream &os) const {
+    os << "aggregate of " << static_cast<int>(count);
+  }
+
+  static bool IsAggregate (Ptr<const Packet> p) {
+    uint8_t first = 0;
+    return p->CopyData (&first, 1) == 1 && first == MARKER;
+  }
+};
+
+// Static-topology link gain cache. Wraps the real propagation loss model and
+// evaluates it once for every ordered (tx, rx) pair at setup; afterwards each
+// CalcRxPower () is a pointer lookup plus one array read. The matrix can be
+// kept on disk, keyed by a hash of the floor plan, so repeated runs skip it.
+// Without a file, Index () replaces the matrix: each pair is evaluated when
+// first asked for, so only the links the planner, the channel or the TX
+// power control actually look at cost anything. Single pairs are kept in a
+// hash table; a transmitter the channel asks about every receiver gets a
+// dense row of its own, which CalcRxPower () reads from then on.
+class LinkGainCache : public PropagationLossModel {
+public:
+  static TypeId GetTypeId () {
+    static TypeId tid = TypeId ("LinkGainCache")
+      .SetParent<PropagationLossModel> ()
+      .AddConstructor<LinkGainCache> ();
+    return tid;
+  }
+
+  void SetUnderlying (Ptr<PropagationLossModel> model) {
+    underlying = model;
+  }
+
+  // Fill the N x N loss matrix (dB) for the given mobility models. If dir is
+  // not empty, a matching file "<dir>/link-gain-<key>.bin" is loaded instead
+  // of recomputing, and a freshly computed matrix is written there.
+  void Precompute (const std::vector<Ptr<MobilityModel> > &mobs, uint64_t key, std::string dir) {
+    n = mobs.size ();
+    loss.assign (n * n, 0);
+    models.clear ();
+    pairs.clear ();
+    rows.clear ();
+    index.clear ();
+    for (uint32_t i = 0; i < n; i++) {
+      index[PeekPointer (mobs[i])] = i;
+    }
+
+    std::string path;
+    if (!dir.empty ()) {
+      std::ostringstream ss;
+      ss << dir << "/link-gain-" << std::hex << std::setfill ('0') << std::setw (16) << key << ".bin";
+      path = ss.str ();
+      if (Load (path, key)) {
+        return;
+      }
+    }
+
+    for (uint32_t tx = 0; tx < n; tx++) {
+      for (uint32_t rx = 0; rx < n; rx++) {
+        if (tx != rx) {
+          loss[tx * n + rx] = -underlying->CalcRxPower (0, mobs[tx], mobs[rx]);
+        }
+      }
+    }
+
+    if (!path.empty ()) {
+      Save (path, key);
+    }
+  }
+
+  // Index the mobility models without evaluating anything (see above).
+  void Index (const std::vector<Ptr<MobilityModel> > &mobs) {
+    models = mobs;
+    n = mobs.size ();
+    loss.clear ();
+    pairs.clear ();
+    rows.assign (n, std::vector<double> ());
+    evaluated = 0;
+    index.clear ();
+    for (uint32_t i = 0; i < n; i++) {
+      index[PeekPointer (mobs[i])] = i;
+    }
+  }
+
+  uint32_t GetN () const {
+    return n;
+  }
+
+  // pairs known so far: all of them with the matrix
+  uint64_t GetEvaluated () const {
+    return loss.empty () ? evaluated : static_cast<uint64_t>(n) * (n - 1);
+  }
+
+  // -1 if the mobility model was not part of Precompute () or Index ()
+  int GetIndex (Ptr<const MobilityModel> mob) const {
+    std::unordered_map<const MobilityModel*, uint32_t>::const_iterator it = index.find (PeekPointer (mob));
+    return it == index.end () ? -1 : static_cast<int>(it->second);
+  }
+
+  double GetLoss (uint32_t tx, uint32_t rx) const {
+    if (!loss.empty ()) {
+      return loss[tx * n + rx];
+    }
+    if (!rows[tx].empty ()) {
+      return rows[tx][rx];
+    }
+    if (tx == rx) {
+      return 0;
+    }
+    std::pair<std::unordered_map<uint64_t, double>::iterator, bool> it =
+      pairs.insert (std::make_pair ((static_cast<uint64_t>(tx) << 32) | rx, 0.0));
+    if (it.second) {
+      it.first->second = -underlying->CalcRxPower (0, models[tx], models[rx]);
+      evaluated++;
+    }
+    return it.first->second;
+  }
+
+  // the losses from tx to every node, by index
+  const double* GetRow (uint32_t tx) const {
+    if (!loss.empty ()) {
+      return &loss[tx * n];
+    }
+    if (rows[tx].empty ()) {
+      std::vector<double> row (n);
+      for (uint32_t rx = 0; rx < n; rx++) {
+        row[rx] = GetLoss (tx, rx);
+        pairs.erase ((static_cast<uint64_t>(tx) << 32) | rx);
+      }
+      rows[tx].swap (row);
+    }
+    return rows[tx].data ();
+  }
+
+private:
+  static const uint32_t MAGIC = 0x4c474331;  // "LGC1"
+
+  virtual double DoCalcRxPower (double txPowerDbm, Ptr<MobilityModel> a, Ptr<MobilityModel> b) const {
+    int tx = GetIndex (a);
+    int rx = GetIndex (b);
+    if (tx < 0 || rx < 0) {  // not a precomputed node: ask the real model
+      return underlying->CalcRxPower (txPowerDbm, a, b);
+    }
+    return txPowerDbm - GetRow (tx)[rx];
+  }
+
+  virtual int64_t DoAssignStreams (int64_t stream) {
+    return underlying->AssignStreams (stream);
+  }
+
+  bool Load (std::string path, uint64_t key) {
+    std::ifstream in (path.c_str (), std::ios::binary);
+    uint32_t magic = 0, fileN = 0;
+    uint64_t fileKey = 0;
+    in.read (reinterpret_cast<char*>(&magic), sizeof (magic));
+    in.read (reinterpret_cast<char*>(&fileN), sizeof (fileN));
+    in.read (reinterpret_cast<char*>(&fileKey), sizeof (fileKey));
+    if (!in || magic != MAGIC || fileN != n || fileKey != key) {
+      return false;
+    }
+    in.read (reinterpret_cast<char*>(loss.data ()), loss.size () * sizeof (double));
+    return static_cast<bool>(in);
+  }
+
+  void Save (std::string path, uint64_t key) const {
+    std::ofstream out (path.c_str (), std::ios::binary | std::ios::trunc);
+    uint32_t magic = MAGIC;
+    out.write (reinterpret_cast<const char*>(&magic), sizeof (magic));
+    out.write (reinterpret_cast<const char*>(&n), sizeof (n));
+    out.write (reinterpret_cast<const char*>(&key), sizeof (key));
+    out.write (reinterpret_cast<const char*>(loss.data ()), loss.size () * sizeof (double));
+    if (!out) {
+      std::cerr << "LinkGainCache: cannot write " << path << std::endl;
+    }
+  }
+
+  Ptr<PropagationLossModel> underlying;
+  uint32_t n = 0;
+  std::vector<double> loss;  // loss[tx * n + rx] in dB
+  std::vector<Ptr<MobilityModel> > models;             // after Index ()
+  mutable std::unordered_map<uint64_t, double> pairs;  // (tx << 32 | rx) -> loss (dB), after Index ()
+  mutable std::vector<std::vector<double> > rows;      // by tx, empty until GetRow ()
+  mutable uint64_t evaluated = 0;
+  std::unordered_map<const MobilityModel*, uint32_t> index;
+};
+
+const int COSIM_TIMEOUT_S = 10;  // (s) longest wait for the plant process to attach or answer
+
+// Simulator end of the shared-memory co-simulation bridge (wsan-cosim.h):
+// the plants of a group step in an external process, one round trip of
+// STEP/OUTPUT messages per group step, so both sides advance in lockstep.
+class CosimBridge {
+public:
+  // create the segment with the loops' models and, if plantProgram is
+  // given, start it against it
+  bool Open (std::string _name, const std::vector<CosimLoop> &loops, std::string plantProgram) {
+    name = _name;
+    mapSize = CosimSize (loops.size ());
+    shm_unlink (name.c_str ());  // a stale segment of a crashed run
+    int fd = shm_open (name.c_str (), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+      return false;
+    }
+    if (ftruncate (fd, mapSize) != 0) {
+      close (fd);
+      return false;
+    }
+    void* map = mmap (0, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    shared = static_cast<CosimShared*>(map);  // zero filled: empty rings
+    shared->magic = COSIM_MAGIC;
+    shared->version = COSIM_VERSION;
+    shared->loops = loops.size ();
+    std::copy (loops.begin (), loops.end (), CosimLoops (shared));
+
+    if (!plantProgram.empty ()) {
+      std::string arg = "--shm=" + name;
+      plantPid = fork ();
+      if (plantPid == 0) {
+        execl (plantProgram.c_str (), plantProgram.c_str (), arg.c_str (), static_cast<char*>(0));
+        _exit (127);
+      }
+    }
+    // wait up to COSIM_TIMEOUT_S for the plant process to attach
+    for (int i = 0; i < COSIM_TIMEOUT_S * 1000 && !shared->attached.load (std::memory_order_acquire); i++) {
+      usleep (1000);
+    }
+    return shared->attached.load (std::memory_order_acquire);
+  }
+
+  bool IsOpen () const {
+    return shared != 0;
+  }
+
+  // one step of the plants of loops[k]: u[k] out, y[k] back. Commands and
+  // outputs are interleaved, so any number of loops fits through the rings.
+  void Step (int64_t now, const std::vector<int> &loops, const std::vector<double> &u, std::vector<double> &y) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+    uint32_t spins = 0;
+    size_t sent = 0, received = 0;
+    while (received < loops.size ()) {
+      bool progress = false;
+      if (sent < loops.size ()) {
+        CosimMessage m = {now, static_cast<uint32_t>(loops[sent]), COSIM_STEP, u[sent]};
+        if (shared->toPlant.Push (m)) {
+          sent++;
+          progress = true;
+        }
+      }
+      CosimMessage m;
+      if (received < sent && shared->toSim.Pop (m)) {
+        NS_ABORT_MSG_IF (m.kind != COSIM_OUTPUT || m.loop != static_cast<uint32_t>(loops[received]) || m.time != now,
+                         "co-simulation out of step at loop " << loops[received]);
+        y[received++] = m.value;
+        progress = true;
+      }
+      if (progress) {
+        spins = 0;
+      } else {
+        CosimBackoff (spins);
+        NS_ABORT_MSG_IF ((spins & 0xfff) == 0 && !Alive (start), "co-simulation: " << failure);
+      }
+    }
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - start).count ();
+    steps++;
+    stepNs += ns;
+    maxStepNs = std::max (maxStepNs, ns);
+  }
+
+  void Close () {
+    if (!shared) {
+      return;
+    }
+    CosimMessage m = {0, 0, COSIM_SHUTDOWN, 0};
+    uint32_t spins = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+    bool alive = true;
+    while (alive && !shared->toPlant.Push (m)) {
+      CosimBackoff (spins);
+      alive = (spins & 0xfff) != 0 || Alive (start);
+    }
+    if (plantPid > 0) {
+      if (!alive) {
+        kill (plantPid, SIGKILL);
+      }
+      waitpid (plantPid, 0, 0);
+    }
+    if (!alive) {
+      std::cerr << "co-simulation: " << failure << " at shutdown" << std::endl;
+    }
+    munmap (shared, mapSize);
+    shm_unlink (name.c_str ());
+    shared = 0;
+  }
+
+  uint64_t steps = 0;
+  int64_t stepNs = 0;     // round trips, summed
+  int64_t maxStepNs = 0;
+
+private:
+  // false once the plant process we started has exited, or the plant has
+  // not answered for COSIM_TIMEOUT_S (the only check for a plant started by hand)
+  bool Alive (std::chrono::steady_clock::time_point since) {
+    if (plantPid > 0) {
+      int status = 0;
+      if (waitpid (plantPid, &status, WNOHANG) == plantPid) {
+        plantPid = -1;
+        std::ostringstream os;
+        if (WIFEXITED (status)) {
+          os << "plant process exited with status " << WEXITSTATUS (status);
+        } else {
+          os << "plant process killed by signal " << WTERMSIG (status);
+        }
+        failure = os.str ();
+        return false;
+      }
+    }
+    if (std::chrono::steady_clock::now () - since > std::chrono::seconds (COSIM_TIMEOUT_S)) {
+      std::ostringstream os;
+      os << "no answer from the plant process for " << COSIM_TIMEOUT_S << " s";
+      failure = os.str ();
+      return false;
+    }
+    return true;
+  }
+
+  CosimShared* shared = 0;
+  size_t mapSize = 0;
+  std::string name;
+  pid_t plantPid = -1;
+  std::string failure;
+};
+
+// Spectrum channel that only delivers a transmission to receivers it can
+// reach. SingleModelSpectrumChannel schedules a StartRx on every PHY for every
+// frame; here receivers are bucketed in a uniform grid, a transmitter only
+// visits the cells within its reach (the farthest receiver whose best-case
+// power, from the link gains, is above minRxDbm; found at its first frame,
+// so only senders pay for it) and each candidate is checked against its gain
+// before anything is scheduled. Candidates are scheduled in AddRx order with
+// the same PSD and delay as the base channel.
+// This is not exact: signals below minRxDbm are not delivered as interference
+// either, so near the noise floor the SINR of a reception comes out slightly
+// higher (about 1 dB with many senders at the default gridMinRxDbm); lower
+// it to trade speed for accuracy. TxSigParams fires and MaxLossDb applies as
+// in the base channel; while anything listens to PathLoss or Gain, which
+// report every receiver, StartTx () falls back to the base channel.
+class GridSpectrumChannel : public SingleModelSpectrumChannel {
+public:
+  static TypeId GetTypeId () {
+    static TypeId tid = TypeId ("GridSpectrumChannel")
+      .SetParent<SingleModelSpectrumChannel> ()
+      .AddConstructor<GridSpectrumChannel> ();
+    return tid;
+  }
+
+  virtual void AddRx (Ptr<SpectrumPhy> phy) {
+    SingleModelSpectrumChannel::AddRx (phy);
+    receivers.push_back (phy);
+  }
+
+  // Index the receivers added so far. Positions must be final and the gains
+  // indexed; maxTxPowerDbm bounds what any PHY transmits with.
+  void BuildIndex (Ptr<LinkGainCache> _gains, Ptr<PropagationDelayModel> _delay,
+                   double maxTxPowerDbm, double minRxDbm, double _cellSize) {
+    gains = _gains;
+    delay = _delay;
+    cellSize = _cellSize;
+    lossBudget = maxTxPowerDbm - minRxDbm;
+
+    uint32_t n = gains->GetN ();
+    rxOrder.assign (n, -1);
+    posX.assign (n, 0);
+    posY.assign (n, 0);
+    reach.assign (n, -1);
+    unindexed.clear ();
+    xMin = yMin = std::numeric_limits<double>::max ();
+    double xMax = -xMin, yMax = -yMin;
+    for (uint32_t r = 0; r < receivers.size (); r++) {
+      Ptr<MobilityModel> mob = receivers[r]->GetMobility ();
+      int i = mob ? gains->GetIndex (mob) : -1;
+      if (i < 0) {  // no precomputed gains: always a candidate
+        unindexed.push_back (r);
+        continue;
+      }
+      Vector pos = mob->GetPosition ();
+      rxOrder[i] = r;
+      posX[i] = pos.x;
+      posY[i] = pos.y;
+      xMin = std::min (xMin, pos.x);
+      yMin = std::min (yMin, pos.y);
+      xMax = std::max (xMax, pos.x);
+      yMax = std::max (yMax, pos.y);
+    }
+    if (xMin > xMax) {  // nothing indexed
+      xMin = yMin = xMax = yMax = 0;
+    }
+    cols = static_cast<int>((xMax - xMin) / cellSize) + 1;
+    rows = static_cast<int>((yMax - yMin) / cellSize) + 1;
+    cells.assign (cols * rows, std::vector<uint32_t> ());
+
+    // receivers go in ascending AddRx order, which each cell keeps
+    for (uint32_t r = 0; r < receivers.size (); r++) {
+      Ptr<MobilityModel> mob = receivers[r]->GetMobility ();
+      int i = mob ? gains->GetIndex (mob) : -1;
+      if (i >= 0) {
+        cells[Cell (posY[i], yMin, rows) * cols + Cell (posX[i], xMin, cols)].push_back (r);
+      }
+    }
+  }
+
+  virtual void StartTx (Ptr<SpectrumSignalParameters> params) {
+    Ptr<MobilityModel> senderMobility = params->txPhy->GetMobility ();
+    int tx = (gains && senderMobility) ? gains->GetIndex (senderMobility) : -1;
+    if (tx < 0 || !m_pathLossTrace.IsEmpty () || !m_gainTrace.IsEmpty ()) {
+      // not indexed (or BuildIndex () not called), or traced per receiver: visit everyone
+      SingleModelSpectrumChannel::StartTx (params);
+      return;
+    }
+    m_txSigParamsTrace (params->Copy ());
+
+    if (reach[tx] < 0) {
+      const double* row = gains->GetRow (tx);
+      reach[tx] = 0;
+      for (uint32_t rx = 0; rx < reach.size (); rx++) {
+        if (rx != static_cast<uint32_t>(tx) && rxOrder[rx] >= 0 && row[rx] <= lossBudget) {
+          double dx = posX[rx] - posX[tx], dy = posY[rx] - posY[tx];
+          reach[tx] = std::max (reach[tx], std::sqrt (dx * dx + dy * dy));
+        }
+      }
+    }
+    candidates.assign (unindexed.begin (), unindexed.end ());
+    int c0 = Cell (posX[tx] - reach[tx], xMin, cols), c1 = Cell (posX[tx] + reach[tx], xMin, cols);
+    int r0 = Cell (posY[tx] - reach[tx], yMin, rows), r1 = Cell (posY[tx] + reach[tx], yMin, rows);
+    for (int r = r0; r <= r1; r++) {
+      for (int c = c0; c <= c1; c++) {
+        const std::vector<uint32_t> &cell = cells[r * cols + c];
+        candidates.insert (candidates.end (), cell.begin (), cell.end ());
+      }
+    }
+    std::sort (candidates.begin (), candidates.end ());
+
+    for (size_t k = 0; k < candidates.size (); k++) {
+      Ptr<SpectrumPhy> rxPhy = receivers[candidates[k]];
+      if (rxPhy == params->txPhy) {
+        continue;
+      }
+      Ptr<MobilityModel> receiverMobility = rxPhy->GetMobility ();
+      int rx = receiverMobility ? gains->GetIndex (receiverMobility) : -1;
+      double rxPowerDb;
+      if (rx >= 0) {
+        if (gains->GetLoss (tx, rx) > lossBudget) {
+          continue;
+        }
+        rxPowerDb = -gains->GetLoss (tx, rx);
+      } else if (receiverMobility) {
+        rxPowerDb = gains->CalcRxPower (0, senderMobility, receiverMobility);
+      } else {
+        rxPowerDb = 0;
+      }
+      if (receiverMobility && -rxPowerDb > m_maxLossDb) {  // beyond range, as in the base channel
+        continue;
+      }
+
+      Time rxDelay = (delay && receiverMobility) ? delay->GetDelay (senderMobility, receiverMobility) : MicroSeconds (0);
+      Ptr<SpectrumSignalParameters> rxParams = params->Copy ();
+      rxParams->psd = Copy<SpectrumValue> (params->psd);
+      *(rxParams->psd) *= std::pow (10.0, rxPowerDb / 10.0);
+      Ptr<NetDevice> netDev = rxPhy->GetDevice ();
+      uint32_t dstNode = netDev ? netDev->GetNode ()->GetId () : 0xffffffff;
+      Simulator::ScheduleWithContext (dstNode, rxDelay, &SpectrumPhy::StartRx, rxPhy, rxParams);
+      scheduled++;
+    }
+    offered += receivers.size () - 1;
+  }
+
+  // receptions scheduled vs. what SingleModelSpectrumChannel would have
+  uint64_t GetScheduled () const {
+    return scheduled;
+  }
+
+  uint64_t GetOffered () const {
+    return offered;
+  }
+
+private:
+  int Cell (double v, double origin, int count) const {
+    int c = static_cast<int>(std::floor ((v - origin) / cellSize));
+    return std::max (0, std::min (count - 1, c));
+  }
+
+  std::vector<Ptr<SpectrumPhy> > receivers;  // in AddRx order
+  Ptr<LinkGainCache> gains;
+  Ptr<PropagationDelayModel> delay;
+  double lossBudget = 0;   // (dB) larger losses are never received
+  double cellSize = 10;    // (m)
+  double xMin = 0, yMin = 0;
+  int cols = 0, rows = 0;
+  std::vector<std::vector<uint32_t> > cells;  // receiver orders, row-major
+  std::vector<uint32_t> unindexed;
+  std::vector<int> rxOrder;                   // by gain index, -1: not a receiver
+  std::vector<double> posX, posY, reach;      // by gain index; reach -1: not sent yet
+  std::vector<uint32_t> candidates;           // scratch for StartTx ()
+  uint64_t scheduled = 0, offered = 0;
+};
+
+// Batched state-space plants: x' = A x + B u, y = C x, for every loop of a
+// group at once. Each matrix element is its own array across loops, so one
+// step is ORDER*(ORDER+2) straight multiply-add sweeps that the compiler
+// vectorizes. Lower-order plants are zero padded up to ORDER.
+template <int ORDER>
+class PlantBank {
+public:
+  std::vector<int> node;               // plant node of each loop
+  std::vector<double> A[ORDER * ORDER];
+  std::vector<double> B[ORDER];
+  std::vector<double> C[ORDER];
+  std::vector<double> X[ORDER];
+  std::vector<double> X_t[ORDER];
+  std::vector<double> U;               // latest actuator command
+  std::vector<double> Y;               // output computed by the last Step ()
+
+  // A is row-major order x order; returns the slot of the new loop
+  int Add (int nodeIdx, int order, const double* _A, const double* _B, const double* _C) {
+    NS_ABORT_MSG_IF (order > ORDER, "plant order " << order << " exceeds PLANT_ORDER " << ORDER);
+    for (int i = 0; i < ORDER; i++) {
+      for (int j = 0; j < ORDER; j++) {
+        A[i * ORDER + j].push_back (i < order && j < order ? _A[i * order + j] : 0);
+      }
+      B[i].push_back (i < order ? _B[i] : 0);
+      C[i].push_back (i < order ? _C[i] : 0);
+      X[i].push_back (0);
+      X_t[i].push_back (0);
+    }
+    node.push_back (nodeIdx);
+    U.push_back (0);
+    Y.push_back (0);
+    return node.size () - 1;
+  }
+
+  int Size () const {
+    return node.size ();
+  }
+
+  // y = C x, then x = A x + B u (same summation order as the scalar code)
+  void Step () {
+    const int n = node.size ();
+    double* __restrict__ y = Y.data ();
+    for (int j = 0; j < ORDER; j++) {
+      const double* __restrict__ c = C[j].data ();
+      const double* __restrict__ x = X[j].data ();
+      for (int k = 0; k < n; k++) {
+        y[k] = (j == 0 ? 0 : y[k]) + c[k] * x[k];
+      }
+    }
+    const double* __restrict__ u = U.data ();
+    for (int i = 0; i < ORDER; i++) {
+      double* __restrict__ xt = X_t[i].data ();
+      for (int j = 0; j < ORDER; j++) {
+        const double* __restrict__ a = A[i * ORDER + j].data ();
+        const double* __restrict__ x = X[j].data ();
+        for (int k = 0; k < n; k++) {
+          xt[k] = (j == 0 ? 0 : xt[k]) + a[k] * x[k];
+        }
+      }
+      const double* __restrict__ b = B[i].data ();
+      for (int k = 0; k < n; k++) {
+        xt[k] += b[k] * u[k];
+      }
+    }
+    for (int i = 0; i < ORDER; i++) {
+      X[i].swap (X_t[i]);
+    }
+  }
+};
+
+// Batched PID controllers, one array per term across loops.
+class PidBank {
+public:
+  std::vector<int> node;  // controller node of each loop
+  std::vector<double> Kp;
+  std::vector<double> Ki;
+  std::vector<double> Kd;
+  std::vector<double> Ts;  // (s) sample time
+  std::vector<double> reference;
+  std::vector<double> Y;   // latest plant output
+  std::vector<double> U;   // command computed by the last Step ()
+  std::vector<double> error_sum;
+  std::vector<double> error_last;
+
+  int Add (int nodeIdx, double _Kp, double _Ki, double _Kd, double _Ts, double _reference) {
+    node.push_back (nodeIdx);
+    Kp.push_back (_Kp);
+    Ki.push_back (_Ki);
+    Kd.push_back (_Kd);
+    Ts.push_back (_Ts);
+    reference.push_back (_reference);
+    Y.push_back (0);
+    U.push_back (0);
+    error_sum.push_back (0);
+    error_last.push_back (0);
+    return node.size () - 1;
+  }
+
+  int Size () const {
+    return node.size ();
+  }
+
+  void Step () {
+    const int n = node.size ();
+    double* __restrict__ u = U.data ();
+    double* __restrict__ sum = error_sum.data ();
+    double* __restrict__ last = error_last.data ();
+    const double* __restrict__ kp = Kp.data ();
+    const double* __restrict__ ki = Ki.data ();
+    const double* __restrict__ kd = Kd.data ();
+    const double* __restrict__ ts = Ts.data ();
+    const double* __restrict__ ref = reference.data ();
+    const double* __restrict__ y = Y.data ();
+    for (int k = 0; k < n; k++) {
+      double error = ref[k] - y[k];
+      u[k] = kp[k] * error + ki[k] * sum[k] + kd[k] * ((error - last[k]) / ts[k]);
+      sum[k] += error * ts[k];
+      last[k] = error;
+    }
+  }
+};
+
+// Simulation-side metadata of a sample (a packet tag, never on air): when it
+// was sent, the sensor sample a command was computed from, and the path
+// taken so far as a PathTrie node.
+class LoopTag : public Tag {
+public:
+  static const uint32_t NO_ORIGIN = 0xffffffff;
+
+  int64_t sendTs      = 0;          // (ns) time the source transmitted
+  uint32_t originUs   = NO_ORIGIN;  // (us) age of the sensor sample at send time
+  uint8_t hops        = 0;          // relays that forwarded this copy
+  uint32_t path       = 0;          // PathTrie id of source + relays
+
+  static TypeId GetTypeId () {
+    static TypeId tid = TypeId ("LoopTag")
+      .SetParent<Tag> ()
+      .AddConstructor<LoopTag> ();
+    return tid;
+  }
+
+  virtual TypeId GetInstanceTypeId () const {
+    return GetTypeId ();
+  }
+
+  virtual uint32_t GetSerializedSize () const {
+    return 8 + 4 + 1 + 4;
+  }
+
+  virtual void Serialize (TagBuffer i) const {
+    i.WriteU64 (sendTs);
+    i.WriteU32 (originUs);
+    i.WriteU8 (hops);
+    i.WriteU32 (path);
+  }
+
+  virtual void Deserialize (TagBuffer i) {
+    sendTs = i.ReadU64 ();
+    originUs = i.ReadU32 ();
+    hops = i.ReadU8 ();
+    path = i.ReadU32 ();
+  }
+
+  virtual void Print (std::ostream &os) const {
+    os << "sendTs=" << sendTs << " hops=" << static_cast<int>(hops) << " path=" << path;
+  }
+};
+
+// Interns node sequences so a whole path fits in a 32-bit tag field.
+class PathTrie {
+public:
+  PathTrie () {
+    parent.push_back (0);  // 0 is the empty path
+    hop.push_back (0);
+  }
+
+  uint32_t Extend (uint32_t id, uint16_t node) {
+    uint64_t key = (static_cast<uint64_t>(id) << 16) | node;
+    std::unordered_map<uint64_t, uint32_t>::iterator it = child.find (key);
+    if (it != child.end ()) {
+      return it->second;
+    }
+    uint32_t next = parent.size ();
+    parent.push_back (id);
+    hop.push_back (node);
+    child[key] = next;
+    return next;
+  }
+
+  std::vector<uint16_t> Get (uint32_t id) const {
+    std::vector<uint16_t> nodes;
+    for (; id != 0; id = parent[id]) {
+      nodes.push_back (hop[id]);
+    }
+    std::reverse (nodes.begin (), nodes.end ());
+    return nodes;
+  }
+
+private:
+  std::vector<uint32_t> parent;
+  std::vector<uint16_t> hop;
+  std::unordered_map<uint64_t, uint32_t> child;
+};
+
+// HDR-style log-linear histogram of microsecond latencies: exact below 16 us,
+// then 16 linear sub-buckets per power of two (<= 6.25% relative error).
+class LatencyHistogram {
+public:
+  static const int SUB_BITS = 4;
+  static const int SUB      = 1 << SUB_BITS;
+  static const int ROWS     = 64 - SUB_BITS + 1;
+
+  uint64_t count = 0;
+  uint64_t min   = UINT64_MAX;
+  uint64_t max   = 0;
+  double sum     = 0;
+
+  LatencyHistogram () : counts (ROWS * SUB, 0) {}
+
+  void Record (uint64_t us) {
+    counts[Index (us)]++;
+    count++;
+    sum += us;
+    min = std::min (min, us);
+    max = std::max (max, us);
+  }
+
+  // highest value equivalent to the q-quantile's bucket
+  uint64_t Quantile (double q) const {
+    uint64_t rank = static_cast<uint64_t>(q * count + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size (); i++) {
+      seen += counts[i];
+      if (seen >= rank && counts[i] > 0) {
+        return std::min (Upper (i), max);
+      }
+    }
+    return max;
+  }
+
+  void WriteJson (std::ostream &os) const {
+    os << "{\"count\":" << count;
+    if (count > 0) {
+      os << ",\"min\":" << min << ",\"mean\":" << sum / count
+         << ",\"p50\":" << Quantile (0.5) << ",\"p90\":" << Quantile (0.9)
+         << ",\"p99\":" << Quantile (0.99) << ",\"max\":" << max;
+    }
+    os << ",\"buckets\":[";
+    bool first = true;
+    for (size_t i = 0; i < counts.size (); i++) {
+      if (counts[i] > 0) {
+        os << (first ? "" : ",") << "[" << Upper (i) << "," << counts[i] << "]";
+        first = false;
+      }
+    }
+    os << "]}";
+  }
+
+private:
+  static int Index (uint64_t v) {
+    if (v < SUB) {
+      return v;
+    }
+    int mag = 63 - __builtin_clzll (v);
+    int shift = mag - SUB_BITS;
+    return (shift + 1) * SUB + ((v >> shift) & (SUB - 1));
+  }
+
+  static uint64_t Upper (size_t i) {
+    if (i < static_cast<size_t>(SUB)) {
+      return i;
+    }
+    int shift = i / SUB - 1;
+    uint64_t lower = static_cast<uint64_t>(SUB + i % SUB) << shift;
+    return lower + (static_cast<uint64_t>(1) << shift) - 1;
+  }
+
+  std::vector<uint32_t> counts;
+};
+
+// One direction of a loop: plant -> controller (uplink) or back (downlink).
+class LegMetrics {
+public:
+  uint64_t sent            = 0;
+  uint64_t delivered       = 0;
+  uint64_t duplicates      = 0;
+  uint64_t deadline_misses = 0;  // delivered later than one period
+  uint64_t skipped         = 0;  // samples the event trigger held back
+  LatencyHistogram latency;
+  std::map<uint32_t, uint64_t> paths;  // PathTrie id -> deliveries
+
+  void WriteJson (std::ostream &os, const PathTrie &trie) const {
+    os << "{\"sent\":" << sent << ",\"delivered\":" << delivered
+       << ",\"duplicates\":" << duplicates << ",\"deadline_misses\":" << deadline_misses
+       << ",\"skipped\":" << skipped
+       << ",\"latency_us\":";
+    latency.WriteJson (os);
+    os << ",\"paths\":[";
+    for (std::map<uint32_t, uint64_t>::const_iterator it = paths.begin (); it != paths.end (); it++) {
+      std::vector<uint16_t> nodes = trie.Get (it->first);
+      os << (it == paths.begin () ? "" : ",") << "{\"path\":[";
+      for (size_t i = 0; i < nodes.size (); i++) {
+        os << (i == 0 ? "" : ",") << nodes[i];
+      }
+      os << "],\"count\":" << it->second << "}";
+    }
+    os << "]}";
+  }
+};
+
+class LoopMetrics {
+public:
+  int controller = -1;
+  int plant      = -1;
+  double period  = 0;  // (s)
+  LegMetrics uplink;
+  LegMetrics downlink;
+  LatencyHistogram loop;  // sensor sample -> actuator command applied
+  uint64_t loop_deadline_misses = 0;
+  double abs_error_sum = 0;   // |reference - Y| at each controller step
+  uint64_t error_samples = 0;
+  int64_t lastSampleTs = -1;  // (ns) send time of the sample the controller holds
+  int channel = 11;           // 802.15.4 channel of the loop (11-26)
+  double quant_abs_sum = 0;   // |payload sent - payload decoded|, compact encodings
+  double quant_max = 0;
+  uint64_t quant_samples = 0;
+  uint64_t quant_saturated = 0;
+};
+
+// Airtime on one 802.15.4 channel, from the PhyTxBegin trace of every radio
+// tuned to it, and how many of those transmissions overlap: the mean number
+// on the air while the channel is busy measures spatial reuse.
+class ChannelStats {
+public:
+  int loops = 0;
+  int radios = 0;
+  uint64_t frames = 0;
+  double airtime = 0;  // (s)
+  double busy = 0;     // (s) with at least one transmission on the air
+  double overlap = 0;  // (s) integral of the transmissions on the air
+  int maxActive = 0;
+
+  void TxBegin (int64_t now, int64_t duration) {
+    Advance (now);
+    ends.push (now + duration);
+    maxActive = std::max (maxActive, static_cast<int>(ends.size ()));
+  }
+
+  // retire the transmissions over by now (idempotent)
+  void Advance (int64_t now) {
+    while (!ends.empty () && ends.top () <= now) {
+      Span (ends.top ());
+      ends.pop ();
+    }
+    Span (now);
+  }
+
+  double Concurrency () const {
+    return busy > 0 ? overlap / busy : 0;
+  }
+
+private:
+  void Span (int64_t to) {
+    if (!ends.empty ()) {
+      busy += (to - lastTs) * 1e-9;
+      overlap += ends.size () * (to - lastTs) * 1e-9;
+    }
+    lastTs = to;
+  }
+
+  std::priority_queue<int64_t, std::vector<int64_t>, std::greater<int64_t> > ends;  // (ns)
+  int64_t lastTs = 0;
+};
+
+// Per-node radio time by PHY state, from the TrxState trace of each of the
+// node's radios, and energy from a current-draw profile. A state change
+// only adds the time since the last one to its bucket.
+class EnergyMeter {
+public:
+  enum Bucket { TX, RX, LISTEN, BUSY, OFF, BUCKETS };  // BUSY: TX_ON and turnarounds
+
+  struct NodeEnergy {
+    int64_t time[BUCKETS] = {0, 0, 0, 0, 0};  // (ns)
+    uint32_t frames = 0;                      // PHY transmissions
+    uint32_t sent = 0;
+    uint32_t relayed = 0;
+    uint32_t discarded = 0;
+  };
+
+  double current[BUCKETS] = {17.4, 18.8, 18.8, 18.8, 0.426};  // (mA) CC2420 at 0 dBm
+  double voltage = 3.0;
+  double batteryMah = 2500;  // two AA cells
+  std::vector<NodeEnergy> nodes;
+
+  static const char* Name (int bucket) {
+    static const char* names[BUCKETS] = {"tx", "rx", "listen", "busy", "off"};
+    return names[bucket];
+  }
+
+  // "tx=17.4,rx=18.8,...": any subset of the buckets, in mA
+  bool SetProfile (std::string profile) {
+    std::istringstream ss (profile);
+    std::string item;
+    while (std::getline (ss, item, ',')) {
+      size_t eq = item.find ('=');
+      int b = 0;
+      while (b < BUCKETS && item.substr (0, eq) != Name (b)) {
+        b++;
+      }
+      if (eq == std::string::npos || b == BUCKETS) {
+        return false;
+      }
+      current[b] = std::atof (item.c_str () + eq + 1);
+    }
+    return true;
+  }
+
+  void Reset (int nodeCount) {
+    nodes.assign (nodeCount, NodeEnergy ());
+    radios.clear ();
+    startTs = 0;
+  }
+
+  int AddRadio (int node) {
+    Radio r = {node, OFF, Simulator::Now ().GetTimeStep ()};  // LrWpanPhy starts in TRX_OFF
+    radios.push_back (r);
+    return radios.size () - 1;
+  }
+
+  void StateChange (int radio, LrWpanPhyEnumeration state) {
+    Radio &r = radios[radio];
+    int64_t now = Simulator::Now ().GetTimeStep ();
+    NodeEnergy &n = nodes[r.node];
+    n.time[r.bucket] += now - r.since;
+    r.since = now;
+    r.bucket = BucketOf (state);
+    n.frames += r.bucket == TX;
+  }
+
+  void Count (int node, TraceEvent event) {
+    NodeEnergy &n = nodes[node];
+    n.sent += event == TRACE_TX;
+    n.relayed += event == TRACE_RELAY;
+    n.discarded += event == TRACE_DISCARD_NOT_MINE || event == TRACE_DISCARD_DUPLICATE;
+  }
+
+  // bring every bucket up to now (idempotent)
+  void Settle () {
+    int64_t now = Simulator::Now ().GetTimeStep ();
+    for (size_t i = 0; i < radios.size (); i++) {
+      nodes[radios[i].node].time[radios[i].bucket] += now - radios[i].since;
+      radios[i].since = now;
+    }
+  }
+
+  // variants compare from the snapshot on
+  void Restart () {
+    Settle ();
+    for (size_t i = 0; i < nodes.size (); i++) {
+      nodes[i] = NodeEnergy ();
+    }
+    startTs = Simulator::Now ().GetTimeStep ();
+  }
+
+  double EnergyMj (int node) const {
+    double mAs = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+      mAs += current[b] * nodes[node].time[b] * 1e-9;
+    }
+    return mAs * voltage;
+  }
+
+  // at the average current of this run
+  double LifetimeDays (int node) const {
+    double elapsed = (Simulator::Now ().GetTimeStep () - startTs) * 1e-9;
+    double mA = elapsed > 0 ? EnergyMj (node) / voltage / elapsed : 0;
+    return mA > 0 ? batteryMah / mA / 24 : std::numeric_limits<double>::max ();
+  }
+
+private:
+  struct Radio {
+    int node;
+    int bucket;
+    int64_t since;
+  };
+
+  static int BucketOf (LrWpanPhyEnumeration state) {
+    switch (state) {
+    case IEEE_802_15_4_PHY_BUSY_TX: return TX;
+    case IEEE_802_15_4_PHY_BUSY_RX: return RX;
+    case IEEE_802_15_4_PHY_RX_ON: return LISTEN;
+    case IEEE_802_15_4_PHY_TRX_OFF: case IEEE_802_15_4_PHY_FORCE_TRX_OFF: return OFF;
+    default: return BUSY;
+    }
+  }
+
+  std::vector<Radio> radios;
+  int64_t startTs = 0;
+};
+
+// Binary event trace (format in wsan-trace.h). The event loop only copies a
+// record into the current block; full blocks are handed to a background
+// thread that writes them out, so tracing never blocks on file I/O.
+class TraceWriter {
+public:
+  static const size_t BLOCK_RECORDS = 8192;
+
+  ~TraceWriter () {
+    Close ();
+  }
+
+  bool Open (std::string path) {
+    file = fopen (path.c_str (), "wb");
+    if (!file) {
+      std::cerr << "TraceWriter: cannot write " << path << std::endl;
+      return false;
+    }
+    TraceFileHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof (TraceRecord), 0, 0};
+    fwrite (&header, sizeof (header), 1, file);
+    current.reserve (BLOCK_RECORDS);
+    done = false;
+    writer = std::thread (&TraceWriter::Drain, this);
+    return true;
+  }
+
+  bool IsOpen () const {
+    return file != 0;
+  }
+
+  void Append (int64_t time, uint16_t node, uint8_t event, uint32_t dsn, double payload) {
+    TraceRecord r = {time, dsn, node, event, 0, payload};
+    current.push_back (r);
+    if (current.size () == BLOCK_RECORDS) {
+      Hand ();
+    }
+  }
+
+  // flush everything, stop the writer thread and finish the header
+  void Close () {
+    if (!file) {
+      return;
+    }
+    Hand ();
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      done = true;
+    }
+    ready.notify_one ();
+    writer.join ();
+    fseek (file, offsetof (TraceFileHeader, record_count), SEEK_SET);
+    fwrite (&written, sizeof (written), 1, file);
+    fclose (file);
+    file = 0;
+  }
+
+private:
+  void Hand () {
+    if (current.empty ()) {
+      return;
+    }
+    std::vector<TraceRecord> next;
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      full.push_back (std::vector<TraceRecord> ());
+      full.back ().swap (current);
+      if (!spare.empty ()) {
+        next.swap (spare.back ());
+        spare.pop_back ();
+      }
+    }
+    ready.notify_one ();
+    next.clear ();
+    next.reserve (BLOCK_RECORDS);
+    current.swap (next);
+  }
+
+  void Drain () {
+    std::unique_lock<std::mutex> lock (mutex);
+    while (true) {
+      ready.wait (lock, [this] { return done || !full.empty (); });
+      if (full.empty () && done) {
+        return;
+      }
+      std::vector<TraceRecord> block;
+      block.swap (full.front ());
+      full.pop_front ();
+      lock.unlock ();
+      fwrite (block.data (), sizeof (TraceRecord), block.size (), file);
+      written += block.size ();
+      lock.lock ();
+      spare.push_back (std::vector<TraceRecord> ());
+      spare.back ().swap (block);
+    }
+  }
+
+  FILE* file = 0;
+  uint64_t written = 0;  // only touched by the writer thread until Close ()
+  std::vector<TraceRecord> current;
+  std::deque<std::vector<TraceRecord> > full;
+  std::vector<std::vector<TraceRecord> > spare;
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::thread writer;
+  bool done = false;
+};
+
+// Multi-path source route planner. Links are weighted by -ln(PRR), where the
+// packet reception ratio follows from the link loss via the 802.15.4 O-QPSK
+// bit error rate; a path's weight is then -ln of its delivery probability.
+// Paths are found one at a time with a hop-limited Bellman-Ford, and the
+// relays of every path found are excluded from the next (node-disjoint).
+class RoutePlanner {
+public:
+  // A link is kept when its PRR in both directions, from the gains, is at
+  // least minPrr. With range > 0 only nodes at most range (m) apart (x, y:
+  // positions by gain index) are links at all: nodes are bucketed in cells
+  // of that size and each pair is looked at only from neighbouring cells,
+  // so the gains of far pairs are never asked for. They are asked for row
+  // by row, in the order Precompute () evaluates them.
+  void Build (Ptr<LinkGainCache> gains, const std::vector<double> &x, const std::vector<double> &y, double range,
+              double txPowerDbm, double noiseDbm, int frameBytes, double minPrr) {
+    n = gains->GetN ();
+    adj.assign (n, std::vector<std::pair<int, double> > ());
+    posX = x;
+    posY = y;
+    linkRange = range;
+    cols = rows = 1;
+    cells.clear ();
+    if (range > 0 && n > 0) {
+      xMin = *std::min_element (x.begin (), x.end ());
+      yMin = *std::min_element (y.begin (), y.end ());
+      cols = static_cast<int>((*std::max_element (x.begin (), x.end ()) - xMin) / range) + 1;
+      rows = static_cast<int>((*std::max_element (y.begin (), y.end ()) - yMin) / range) + 1;
+      cells.assign (cols * rows, std::vector<int> ());
+      for (int a = 0; a < n; a++) {
+        cells[CellOf (a)].push_back (a);
+      }
+    }
+
+    // rows of (neighbour, loss), neighbours ascending
+    std::vector<size_t> start (n + 1, 0);
+    std::vector<int> other;
+    std::vector<double> loss;
+    std::vector<int> near;
+    for (int a = 0; a < n; a++) {
+      Near (a, near);
+      for (size_t k = 0; k < near.size (); k++) {
+        other.push_back (near[k]);
+        loss.push_back (gains->GetLoss (a, near[k]));
+      }
+      start[a + 1] = other.size ();
+    }
+    for (int a = 0; a < n; a++) {
+      for (size_t k = std::upper_bound (other.begin () + start[a], other.begin () + start[a + 1], a) - other.begin ();
+           k < start[a + 1]; k++) {
+        int b = other[k];
+        size_t back = std::lower_bound (other.begin () + start[b], other.begin () + start[b + 1], a) - other.begin ();
+        double prr = std::min (Prr (txPowerDbm - loss[k] - noiseDbm, frameBytes),
+                               Prr (txPowerDbm - loss[back] - noiseDbm, frameBytes));
+        if (prr >= minPrr) {
+          adj[a].push_back (std::make_pair (b, -std::log (prr)));
+          adj[b].push_back (std::make_pair (a, -std::log (prr)));
+        }
+      }
+    }
+  }
+
+  // links kept by Build (), each counted once
+  uint64_t GetLinks () const {
+    uint64_t links = 0;
+    for (int a = 0; a < n; a++) {
+      links += adj[a].size ();
+    }
+    return links / 2;
+  }
+
+  // Up to k node-disjoint src -> dst paths of at most maxHops links each,
+  // never relaying through a node marked in endpoints (the controllers and
+  // plants of all loops, which do not forward); stops early once the chance
+  // that at least one path delivers reaches target. Returns the combined
+  // delivery probability.
+  double Plan (int src, int dst, int k, int maxHops, double target, const std::vector<uint8_t> &endpoints,
+               std::vector<std::vector<uint16_t> > &paths) const {
+    std::vector<uint8_t> blocked (endpoints);
+    double missAll = 1;
+    paths.clear ();
+    while (static_cast<int>(paths.size ()) < k && 1 - missAll < target) {
+      std::vector<uint16_t> path;
+      double weight = ShortestPath (src, dst, maxHops, blocked, path);
+      if (path.empty ()) {
+        break;
+      }
+      missAll *= 1 - std::exp (-weight);
+      for (size_t i = 1; i + 1 < path.size (); i++) {
+        blocked[path[i]] = 1;
+      }
+      paths.push_back (path);
+      if (path.size () == 2) {  // direct link: nothing left to make disjoint
+        break;
+      }
+    }
+    return 1 - missAll;
+  }
+
+  // 802.15.4 2.4 GHz O-QPSK, same expression as LrWpanErrorModel
+  static double Prr (double snrDb, int frameBytes) {
+    if (snrDb >= 8) {  // BER below 1e-12: skip the series
+      return 1;
+    }
+    if (snrDb <= -8) {
+      return 0;
+    }
+    double snr = std::pow (10.0, snrDb / 10.0);
+    double ber = 0;
+    double binom = 1;  // C(16, k)
+    for (int k = 1; k <= 16; k++) {
+      binom = binom * (16 - k + 1) / k;
+      if (k >= 2) {
+        ber += (k % 2 == 0 ? 1 : -1) * binom * std::exp (20 * snr * (1.0 / k - 1));
+      }
+    }
+    ber *= 8.0 / 15 / 16;
+    ber = std::min (std::max (ber, 0.0), 1.0);
+    return std::pow (1 - ber, 8 * frameBytes);
+  }
+
+private:
+  int CellOf (int a) const {
+    return static_cast<int>((posY[a] - yMin) / linkRange) * cols + static_cast<int>((posX[a] - xMin) / linkRange);
+  }
+
+  // the other nodes within linkRange of a, ascending
+  void Near (int a, std::vector<int> &near) const {
+    near.clear ();
+    if (linkRange <= 0) {
+      for (int b = 0; b < n; b++) {
+        if (b != a) {
+          near.push_back (b);
+        }
+      }
+      return;
+    }
+    int c = CellOf (a) % cols, r = CellOf (a) / cols;
+    for (int rr = std::max (0, r - 1); rr <= std::min (rows - 1, r + 1); rr++) {
+      for (int cc = std::max (0, c - 1); cc <= std::min (cols - 1, c + 1); cc++) {
+        const std::vector<int> &cell = cells[rr * cols + cc];
+        for (size_t k = 0; k < cell.size (); k++) {
+          int b = cell[k];
+          double dx = posX[b] - posX[a], dy = posY[b] - posY[a];
+          if (b != a && dx * dx + dy * dy <= linkRange * linkRange) {
+            near.push_back (b);
+          }
+        }
+      }
+    }
+    std::sort (near.begin (), near.end ());
+  }
+
+  // hop-limited Bellman-Ford; returns the path weight (+inf if none). A
+  // round only relaxes the nodes the previous one improved (no other can
+  // improve anything), in ascending order as a full sweep would, and skips
+  // those already no closer than the best path to dst found so far or, with
+  // a link range, too far from dst for the hops left.
+  double ShortestPath (int src, int dst, int maxHops, const std::vector<uint8_t> &blocked,
+                       std::vector<uint16_t> &path) const {
+    const double INF = std::numeric_limits<double>::infinity ();
+    std::vector<double> dist (n, INF), next (n, INF);
+    std::vector<int> pred ((maxHops + 1) * n, -1);  // pred[h * n + v]
+    std::vector<int> frontier (1, src), improved;
+    std::vector<uint8_t> marked (n, 0);
+    dist[src] = 0;
+    double best = INF;
+    int bestHops = -1;
+    for (int h = 1; h <= maxHops; h++) {
+      next = dist;
+      bool changed = false;
+      for (size_t f = 0; f < frontier.size (); f++) {
+        int u = frontier[f];
+        if ((blocked[u] && u != src) || (u == dst) || dist[u] >= best) {
+          continue;
+        }
+        double dx = posX[dst] - posX[u], dy = posY[dst] - posY[u], left = (maxHops - h + 1) * linkRange;
+        if (linkRange > 0 && dx * dx + dy * dy > left * left) {
+          continue;
+        }
+        for (size_t e = 0; e < adj[u].size (); e++) {
+          int v = adj[u][e].first;
+          double w = dist[u] + adj[u][e].second;
+          if (v != src && !(blocked[v] && v != dst) && w < next[v]) {
+            next[v] = w;
+            pred[h * n + v] = u;
+            changed = true;
+            if (!marked[v]) {
+              marked[v] = 1;
+              improved.push_back (v);
+            }
+          }
+        }
+      }
+      dist.swap (next);
+      for (size_t f = 0; f < improved.size (); f++) {
+        marked[improved[f]] = 0;
+      }
+      std::sort (improved.begin (), improved.end ());
+      frontier.swap (improved);
+      improved.clear ();
+      if (pred[h * n + dst] >= 0 && dist[dst] < best) {
+        best = dist[dst];
+        bestHops = h;
+      }
+      if (!changed) {
+        break;
+      }
+    }
+    path.clear ();
+    if (bestHops < 0) {
+      return INF;
+    }
+    // walk back: v was last improved at the highest level h with a pred
+    int v = dst;
+    int h = bestHops;
+    while (v != src) {
+      while (pred[h * n + v] < 0) {
+        h--;
+      }
+      path.push_back (v);
+      v = pred[h * n + v];
+      h--;
+    }
+    path.push_back (src);
+    std::reverse (path.begin (), path.end ());
+    return best;
+  }
+
+  int n = 0;
+  std::vector<std::vector<std::pair<int, double> > > adj;  // neighbour, -ln(PRR)
+  std::vector<double> posX, posY;
+  double linkRange = 0;  // (m) 0: none
+  double xMin = 0, yMin = 0;
+  int cols = 1, rows = 1;
+  std::vector<std::vector<int> > cells;  // nodes by linkRange-sized cell, row-major
+};
+
+// Per-node application state, one contiguous array per field (index = node).
+class DeviceStructure {
+public:
+  std::vector<int> node_role;    // Default : RELAY_NODE_ROLE
+  std::vector<int> destination;
+
+  std::vector<int> group;        // loop group of a controller/plant, -1 for relays
+  std::vector<int> slot;         // index inside that group's bank
+  std::vector<int> loop;         // index into loopMetrics, -1 for relays
+
+  std::vector<DsnTable> DSN_Table;
+
+  std::vector<SourceRoute> SRN;
+  std::vector<uint8_t> seq;
+
+  std::vector<uint8_t> rxTrigger;  // bool
+
+  std::vector<double> lastSent;     // event-triggered mode: value of the last sample sent
+  std::vector<int64_t> lastSentTs;  // and when, -1: never
+
+  void Resize (int n) {
+    node_role.assign (n, 0);
+    destination.assign (n, -1);
+    group.assign (n, -1);
+    slot.assign (n, -1);
+    loop.assign (n, -1);
+    DSN_Table.assign (n, DsnTable ());
+    SRN.assign (n, SourceRoute ());
+    seq.assign (n, 0);
+    rxTrigger.assign (n, 0);
+    lastSent.assign (n, 0);
+    lastSentTs.assign (n, -1);
+  }
+};
+// END CLASS SPACE =============================================================
+
+// CONTSTANT ===================================================================
+const int PLANT_SIZE                 = 1;
+const int PLANT_ORDER                = 3;       // highest plant order the engine supports
+const int PLAN_NODE_SIZE             = 23;      // nodes placed by the built-in floor plan
+const int MAX_NODE_SIZE              = 0xfffe;  // ff:ff is the broadcast address
+const int CONTROLLER_ROLE            = 2;
+const int PLANT_ROLE                 = 1;
+const int RELAY_NODE_ROLE            = 0;
+const int FIXED_ROUTE_HOPS           = 6;
+const uint16_t FIXED_ROUTE[FIXED_ROUTE_HOPS] = {3, 9, 15, 6, 17, 20};  // relays without planned routes
+// const uint8_t CONTROLLER_DIRECTION   = 0;
+// const uint8_t PLANT_DIRECTION        = 1;
+// END CONTSTANT ===============================================================
+
+int nodeSize = PLAN_NODE_SIZE;
+
+std::vector<Ptr<Node> > nodes;
+std::vector<Ptr<LrWpanNetDevice> > devices;
+std::vector<Ptr<MobilityModel> > mobilities;
+std::vector<Ptr<MobilityBuildingInfo> > buildingInfos;
+
+DeviceStructure _devices;
+
+// The built-in floor plan, in the layout of a compiled scenario file
+// (scratch/wsan-floor.scn is its source).
+const ScenarioHeader BUILTIN_HEADER = {
+  SCENARIO_MAGIC, SCENARIO_VERSION, PLAN_NODE_SIZE, 1, 2, 0,
+  40, 15, 1, Building::Residential, Building::ConcreteWithWindows, 0,
+  {-20, 60, 0, 30, 0, 0}, 0.2
+};
+
+const ScenarioNode BUILTIN_NODES[PLAN_NODE_SIZE] = {
+  {27,2,0},
+  {44,27,0},
+  {26,5,0},
+  {19,8,0},
+  {23,8,0},
+  {29,8,0},
+  {37,8,0},
+  {48,8,0},
+  {10,10,0},
+  {20,11,0},
+  {25,11,0},
+  {30,11,0},
+  {26,18,0},
+  {31,18,0},
+  {14,19,0},
+  {22,20,0},
+  {29,20,0},
+  {37.5,19,0},
+  {48,19,0},
+  {31,22,0},
+  {42,22,0},
+  {34,25,0},
+  {38,26,0},
+};
+
+// DC Motor Position Control
+const ScenarioModel BUILTIN_MODELS[1] = {
+  {3, 0,
+   {1, 0.0168850192401696,    9.85229679853156e-05,
+    0, 7.17313525970281e-06,  4.18564730646073e-08,
+    0, -4.91379773242829e-08, -2.86728515475999e-10},
+   {6.56042165678637, 35.8265338128420, 0.00458824345371420},
+   {1, 0, 0}}
+};
+
+// PI controllers; period 0: --period
+const ScenarioLoop BUILTIN_LOOPS[2] = {
+  {0, 1, 0, 0, 0, 0, 0, 10, 0.060826, 0.030286, 0},
+  {2, 22, 0, 0, 0, 0, 0, 10, 0.060826, 0.030286, 0}
+};
+
+static_assert (Building::Commercial + 1 == SCENARIO_BUILDING_TYPES &&
+               Building::StoneBlocks + 1 == SCENARIO_WALL_TYPES, "wsan-scenario.h building types");
+
+// What a run is built from: the built-in plan, or a file compiled by
+// wsan-scenario-compile, mapped read-only and used in place.
+class ScenarioFile {
+public:
+  const ScenarioHeader* header;
+  const ScenarioNode* nodes;
+  const ScenarioModel* models;
+  const ScenarioLoop* loops;
+  const uint16_t* routeHops;
+
+  ScenarioFile () : header (&BUILTIN_HEADER), nodes (BUILTIN_NODES), models (BUILTIN_MODELS),
+                    loops (BUILTIN_LOOPS), routeHops (0), map (0), mapSize (0) {}
+
+  ~ScenarioFile () {
+    if (map) {
+      munmap (map, mapSize);
+    }
+  }
+
+  bool Open (std::string path) {
+    int fd = open (path.c_str (), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    fstat (fd, &st);
+    size_t size = st.st_size;
+    void* m = size >= sizeof (ScenarioHeader) ? mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close (fd);
+    if (m == MAP_FAILED) {
+      return false;
+    }
+    if (!ScenarioValid (m, size, MAX_NODE_SIZE, PLANT_ORDER)) {
+      munmap (m, size);
+      return false;
+    }
+    const ScenarioHeader* h = static_cast<const ScenarioHeader*>(m);
+    map = m;
+    mapSize = size;
+    header = h;
+    nodes = reinterpret_cast<const ScenarioNode*>(h + 1);
+    models = reinterpret_cast<const ScenarioModel*>(nodes + h->nodes);
+    loops = reinterpret_cast<const ScenarioLoop*>(models + h->models);
+    routeHops = reinterpret_cast<const uint16_t*>(loops + h->loops);
+    return true;
+  }
+
+  bool HasRoutes () const {
+    return header->routeHops > 0;
+  }
+
+private:
+  void* map;
+  size_t mapSize;
+};
+
+ScenarioFile scenario;
+std::string scenarioFile = "";  // empty: the built-in plan
+
+// All loops sharing a sampling period are stepped together in one event.
+class LoopGroup {
+public:
+  double interval = 0;  // (s) sampling period
+  PidBank controllers;
+  PlantBank<PLANT_ORDER> plants;
+  int controllerCycle = -1;     // cycle argument of the pending ControllerTxCallback, -1: none
+  int64_t controllerNextTs = 0; // and when it fires
+  int plantCycle = -1;
+  int64_t plantNextTs = 0;
+};
+
+std::vector<LoopGroup> loopGroups;
+
+std::vector<LoopMetrics> loopMetrics;
+PathTrie pathTrie;
+std::string metricsFile = "loop-metrics.json";  // empty: no dump
+
+int loopCount = 2;             // loops 0<->1 and 2<->22, then pairs of unused nodes
+double controlPeriod = 0.2;    // (s)
+int controlCycles = 100;       // samples per controller/plant
+std::string statsFile = "";    // run-time statistics as JSON (empty: none)
+
+int replications = 0;          // > 0: driver mode, one child process per run
+int replicationJobs = 0;       // concurrent children (0: one per core)
+int minReplications = 5;
+double replicationPrecision = 0.05;  // target CI half-width relative to the mean
+
+double snapshotAt = 0;         // (s) > 0: snapshot and/or fork variants at this time
+std::string snapshotFile = ""; // application state written at snapshotAt (empty: none)
+std::string restoreFile = "";  // start from a snapshot instead of t = 0
+std::string variants = "";     // ';'-separated option sets, one forked run each at snapshotAt
+std::vector<pid_t> variantPids;
+Ptr<LinkGainCache> routeGains; // what PlanRoutes () ran on, for variants
+
+bool plannedRoutes = true;      // false: the hand-picked relay set in ControllerTxCallback
+int routePaths = 2;              // node-disjoint paths per loop at most
+int routeMaxHops = 8;
+double routeReliability = 0.999; // stop adding paths once reached
+double routeMinPrr = 0.5;        // weaker links are not used
+double routeRange = 30;          // (m) longer links are not used, 0: no limit (every pair's gain is needed)
+double routeTxPowerDbm = 0;      // LrWpanPhy default
+double routeNoiseDbm = -111;     // thermal noise over 2 MHz
+const int ROUTE_FRAME_BYTES = 32; // PHY + MAC overhead + PacketStructure
+std::vector<std::vector<std::vector<uint16_t> > > loopRoutes;  // planned paths per loop, controller first
+
+bool txPowerControl = false;     // lowest TX power that reaches the next hops of the planned paths
+double txPowerMargin = 6;        // (dB) on top of the receive power such a hop needs
+double txPowerMinDbm = -25;      // CC2420's lowest setting
+const double TX_POWER_PRR = 0.99; // of a hop at the needed receive power
+std::vector<std::vector<int> > txPowers;  // per node: dBm of its radio, then of its bridge radios
+
+bool useTdma = false;            // send only in slots of a superframe built from the routes
+double slotLength = 0.005;       // (s) room for unslotted CSMA backoff plus one frame
+int64_t superframeTs = 0;        // superframe length (one control period)
+std::unordered_map<uint64_t, int64_t> tdmaSlots;  // SlotKey () -> offset in the superframe
+
+TraceWriter tracer;
+std::string traceFile = "";  // empty: tracing off
+
+McpsDataRequestParams txParams;
+
+double dsnWindow = 1;  // (s) how long a DSN is remembered for duplicate suppression
+
+// Rebroadcast suppression: a relay waits a random delay before forwarding and
+// drops the forward once it has heard suppressCopies copies of the DSN from
+// nodes closer to the destination than itself.
+class PendingRelay {
+public:
+  EventId event;
+  int copies = 0;
+};
+
+// Event-triggered sending: an endpoint only sends when its value moved by more
+// than the threshold since its last sample, or the heartbeat is due.
+enum SendTrigger {
+  TRIGGER_PERIODIC,  // every period (the original behaviour)
+  TRIGGER_ABSOLUTE,  // |v - v_sent| > threshold
+  TRIGGER_RELATIVE,  // |v - v_sent| > threshold * |v_sent|
+  TRIGGER_STATE      // |v - v_sent| > threshold * |state| (controller: error, plant: ||x||)
+};
+
+std::string triggerMode = "periodic";
+SendTrigger sendTrigger = TRIGGER_PERIODIC;
+double triggerThreshold = 0.05;
+double heartbeat = 1.0;  // (s) longest silence of an event-triggered endpoint
+
+int suppressCopies = 0;          // 0: always forward
+double suppressDelay = 0.002;    // (s) upper bound of the random rebroadcast delay
+Ptr<UniformRandomVariable> suppressJitter;
+std::unordered_map<uint64_t, PendingRelay> pendingRelays;  // (node, DSN) -> delayed forward
+uint64_t suppressedRelays = 0;
+double suppressedAirtime = 0;    // (s)
+
+bool useLinkGainCache = true;
+std::string linkGainCacheDir = "";  // empty: no matrix, each link's gain evaluated on first use
+
+const int FIRST_CHANNEL = 11;      // 2.4 GHz O-QPSK channels 11-26
+const int CHANNEL_COUNT_MAX = 16;
+const double PHY_BIT_RATE = 250e3;  // (bit/s)
+const int PHY_OVERHEAD_BYTES = 6;   // SHR + PHR
+const double PHY_RX_SENSITIVITY_DBM = -106.58;  // LrWpanPhy default
+const int MAC_OVERHEAD_BYTES = 11;  // broadcast data frame: MHR with short addresses + FCS
+int channelCount = 1;               // loops are spread round robin over this many channels
+bool bridgeRelays = true;           // relays shared by loops on different channels get a radio per channel
+std::vector<std::vector<std::pair<int, Ptr<LrWpanNetDevice> > > > bridgeRadios;  // per node: (channel, radio)
+std::vector<ChannelStats> channelStats;
+
+bool useEnergy = false;          // per-node radio state time and energy
+std::string energyProfile = "";  // current draw per state, e.g. "tx=17.4,off=0.02" (mA; empty: CC2420)
+EnergyMeter energy;
+
+// Relay aggregation: samples a relay forwards on one radio and in one
+// direction within the window leave together in one frame, as long as it
+// fits into the MPDU. With --tdma the frame takes the first sample's slot.
+class RelayQueue {
+public:
+  int loop = -1;                  // of the first sample
+  std::vector<Ptr<Packet> > samples;
+  std::vector<int64_t> enqueued;  // (ns)
+  uint32_t bytes = 0;
+  EventId flush;
+};
+
+double aggregateWindow = 0;        // (s) 0: forward every sample on its own
+const int MAX_MSDU_BYTES = 127 - MAC_OVERHEAD_BYTES;  // aMaxPHYPacketSize
+std::map<std::tuple<int, int, bool>, RelayQueue> relayQueues;  // (node, channel, uplink)
+uint64_t aggregatedFrames = 0;
+uint64_t aggregatedSamples = 0;
+int64_t aggregateDelaySum = 0;     // (ns) waiting in relay queues, all samples
+int64_t aggregateDelayMax = 0;
+uint64_t aggregateDelaySamples = 0;
+double aggregatedAirtime = 0;      // (s) per-frame overhead not sent
+
+CosimBridge cosim;
+std::string cosimShm = "";     // shared memory name of the plant process (empty: built-in plants)
+std::string cosimPlant = "";   // plant program started against it (empty: attach to one started by hand)
+
+std::string profileFile = "profile";  // -DWSAN_PROFILE builds: <file>.folded and <file>.queue.csv (empty: summary only)
+double profileInterval = 0.01;         // (s) event queue sampling interval
+
+bool useRealtime = false;         // pace events against the wall clock (ns3::RealtimeSimulatorImpl)
+double realtimeTolerance = 0.001; // (s) lag at a period start beyond this is an overrun
+std::vector<int64_t> pacingLag;   // (ns) wall clock minus simulation time, one per group and control period
+std::chrono::steady_clock::time_point pacingStart;
+
+std::string encodingName = "full";  // full, fixed or half
+int loopSeqBits = 8;                 // compact encodings: 8 or 12
+double payloadScale = 1.0 / 1024;    // fixed point: value of one LSB (+-32 range)
+
+bool useGridChannel = false;    // skip receivers that cannot hear a frame (needs linkGainCache; not exact)
+double gridMinRxDbm = -117;     // 10 dB below LrWpanPhy's sensitivity (still interference, see GridSpectrumChannel)
+double gridCellSize = 10;       // (m)
+double gridMaxTxPowerDbm = 0;   // highest TX power any PHY uses
+
+// node index == 16-bit short address
+int GetNodeIndex (Mac16Address addr) {
+  uint8_t buf[2];  // if 00:01, [0] = 00 and [1] = 01
+  addr.CopyTo (buf);
+  return (buf[0] << 8) | buf[1];
+}
+
+// FNV-1a over everything the static link gains depend on: node positions,
+// the building, and the RNG seed/run (which fix the shadowing draws).
+uint64_t HashBytes (uint64_t h, const void* data, size_t len) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < len; i++) {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t LinkGainKey (const std::vector<Ptr<MobilityModel> > &mobs, Ptr<Building> building) {
+  uint64_t h = 14695981039346656037ULL;
+  uint32_t n = mobs.size ();
+  h = HashBytes (h, &n, sizeof (n));
+  for (uint32_t i = 0; i < n; i++) {
+    Vector pos = mobs[i]->GetPosition ();
+    double xyz[3] = {pos.x, pos.y, pos.z};
+    h = HashBytes (h, xyz, sizeof (xyz));
+  }
+  Box box = building->GetBoundaries ();
+  double bounds[6] = {box.xMin, box.xMax, box.yMin, box.yMax, box.zMin, box.zMax};
+  h = HashBytes (h, bounds, sizeof (bounds));
+  uint32_t layout[5] = {building->GetNRoomsX (), building->GetNRoomsY (), building->GetNFloors (),
+                        static_cast<uint32_t>(building->GetBuildingType ()),
+                        static_cast<uint32_t>(building->GetExtWallsType ())};
+  h = HashBytes (h, layout, sizeof (layout));
+  uint64_t rng[2] = {RngSeedManager::GetSeed (), RngSeedManager::GetRun ()};
+  h = HashBytes (h, rng, sizeof (rng));
+  return h;
+}
+
+// Close a loop between ctrlIdx and plantIdx with its own gains and plant
+// model (A is row-major order x order).
+void AddLoop (int ctrlIdx, int plantIdx, double interval, double reference,
+              double _Kp, double _Ki, double _Kd,
+              int order, const double* A, const double* B, const double* C) {
+  int g = 0;
+  while (g < static_cast<int>(loopGroups.size ()) && loopGroups[g].interval != interval) {
+    g++;
+  }
+  if (g == static_cast<int>(loopGroups.size ())) {
+    loopGroups.push_back (LoopGroup ());
+    loopGroups[g].interval = interval;
+  }
+
+  _devices.node_role[ctrlIdx] = CONTROLLER_ROLE;
+  _devices.destination[ctrlIdx] = plantIdx;
+  _devices.group[ctrlIdx] = g;
+  _devices.slot[ctrlIdx] = loopGroups[g].controllers.Add (ctrlIdx, _Kp, _Ki, _Kd, interval, reference);
+
+  _devices.node_role[plantIdx] = PLANT_ROLE;
+  _devices.destination[plantIdx] = ctrlIdx;
+  _devices.group[plantIdx] = g;
+  _devices.slot[plantIdx] = loopGroups[g].plants.Add (plantIdx, order, A, B, C);
+
+  LoopMetrics metrics;
+  metrics.controller = ctrlIdx;
+  metrics.plant = plantIdx;
+  metrics.period = interval;
+  _devices.loop[ctrlIdx] = _devices.loop[plantIdx] = loopMetrics.size ();
+  loopMetrics.push_back (metrics);
+  FrameCodec::Get ().AddLoop (ctrlIdx, plantIdx, payloadScale);
+}
+
+// shortest control period of any loop (s)
+double MinLoopPeriod () {
+  double period = std::numeric_limits<double>::max ();
+  for (size_t l = 0; l < loopMetrics.size (); l++) {
+    period = std::min (period, loopMetrics[l].period);
+  }
+  return period;
+}
+
+// source side: stamp the sample and count it as sent
+void RecordTx (int devIdx, Ptr<Packet> pkt) {
+  LoopTag tag;
+  int64_t now = Simulator::Now ().GetTimeStep ();
+  tag.sendTs = now;
+  tag.path = pathTrie.Extend (0, devIdx);
+
+  LoopMetrics &m = loopMetrics[_devices.loop[devIdx]];
+  if (_devices.node_role[devIdx] == CONTROLLER_ROLE) {
+    m.downlink.sent++;
+    if (m.lastSampleTs >= 0) {
+      tag.originUs = static_cast<uint32_t>(std::min<int64_t> (TimeStep (now - m.lastSampleTs).GetMicroSeconds (),
+                                                              LoopTag::NO_ORIGIN - 1));
+    }
+  } else {
+    m.uplink.sent++;
+  }
+  pkt->AddPacketTag (tag);
+}
+
+// relay side: one more hop on this copy's path
+void RecordRelay (int myIdx, Ptr<Packet> p) {
+  LoopTag tag;
+  if (p->RemovePacketTag (tag)) {
+    tag.hops++;
+    tag.path = pathTrie.Extend (tag.path, myIdx);
+    p->AddPacketTag (tag);
+  }
+}
+
+// destination side: first copy of a sample accepted
+void RecordDelivery (int myIdx, Ptr<Packet> p) {
+  LoopTag tag;
+  if (!p->PeekPacketTag (tag)) {
+    return;
+  }
+  LoopMetrics &m = loopMetrics[_devices.loop[myIdx]];
+  bool atController = _devices.node_role[myIdx] == CONTROLLER_ROLE;
+  LegMetrics &leg = atController ? m.uplink : m.downlink;
+  int64_t now = Simulator::Now ().GetTimeStep ();
+  Time latency = TimeStep (now - tag.sendTs);
+  Time period = Seconds (m.period);
+
+  leg.delivered++;
+  leg.latency.Record (latency.GetMicroSeconds ());
+  leg.paths[tag.path]++;
+  if (latency > period) {
+    leg.deadline_misses++;
+  }
+
+  if (atController) {
+    m.lastSampleTs = tag.sendTs;
+  } else if (tag.originUs != LoopTag::NO_ORIGIN) {
+    uint64_t loopUs = latency.GetMicroSeconds () + tag.originUs;
+    m.loop.Record (loopUs);
+    if (MicroSeconds (loopUs) > period) {
+      m.loop_deadline_misses++;
+    }
+  }
+}
+
+void RecordDuplicate (int myIdx) {
+  LoopMetrics &m = loopMetrics[_devices.loop[myIdx]];
+  (_devices.node_role[myIdx] == CONTROLLER_ROLE ? m.uplink : m.downlink).duplicates++;
+}
+
+// What one replication reports back to the driver.
+class RunSummary {
+public:
+  static const int METRICS = 3;
+  double value[METRICS] = {0,};  // delivery ratio, loop latency (ms), mean |error|
+
+  static const char* Name (int i) {
+    static const char* names[METRICS] = {"delivery_ratio", "loop_latency_ms", "control_error"};
+    return names[i];
+  }
+};
+
+RunSummary SummarizeRun () {
+  uint64_t sent = 0, delivered = 0, loopSamples = 0, errorSamples = 0;
+  double loopSumUs = 0, errorSum = 0;
+  for (size_t i = 0; i < loopMetrics.size (); i++) {
+    const LoopMetrics &m = loopMetrics[i];
+    sent += m.uplink.sent + m.downlink.sent;
+    delivered += m.uplink.delivered + m.downlink.delivered;
+    loopSamples += m.loop.count;
+    loopSumUs += m.loop.sum;
+    errorSum += m.abs_error_sum;
+    errorSamples += m.error_samples;
+  }
+  RunSummary r;
+  r.value[0] = sent ? static_cast<double>(delivered) / sent : 0;
+  r.value[1] = loopSamples ? loopSumUs / loopSamples / 1000 : 0;
+  r.value[2] = errorSamples ? errorSum / errorSamples : 0;
+  return r;
+}
+
+// Running mean/variance (Welford) with a 95% Student-t confidence interval.
+class ReplicationStats {
+public:
+  uint64_t n = 0;
+  double mean = 0;
+  double m2 = 0;
+
+  void Add (double x) {
+    n++;
+    double d = x - mean;
+    mean += d / n;
+    m2 += d * (x - mean);
+  }
+
+  double HalfWidth () const {
+    if (n < 2) {
+      return std::numeric_limits<double>::infinity ();
+    }
+    static const double t975[30] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    double t = n - 1 <= 30 ? t975[n - 2] : 1.960;
+    return t * std::sqrt (m2 / (n - 1) / n);
+  }
+
+  bool Converged (double precision) const {
+    return HalfWidth () <= precision * std::fabs (mean);
+  }
+};
+
+// delivered / sent over both legs of all loops
+double DeliveryRatio () {
+  uint64_t sent = 0, delivered = 0;
+  for (size_t i = 0; i < loopMetrics.size (); i++) {
+    sent += loopMetrics[i].uplink.sent + loopMetrics[i].downlink.sent;
+    delivered += loopMetrics[i].uplink.delivered + loopMetrics[i].downlink.delivered;
+  }
+  return sent ? static_cast<double>(delivered) / sent : 0;
+}
+
+// Transmissions on the air at once while a channel is busy, over all
+// channels; maxActive: the most on one channel.
+double Concurrency (int &maxActive) {
+  double busy = 0, overlap = 0;
+  maxActive = 0;
+  for (size_t c = 0; c < channelStats.size (); c++) {
+    channelStats[c].Advance (Simulator::Now ().GetTimeStep ());
+    busy += channelStats[c].busy;
+    overlap += channelStats[c].overlap;
+    maxActive = std::max (maxActive, channelStats[c].maxActive);
+  }
+  return busy > 0 ? overlap / busy : 0;
+}
+
+// (us) sensor sample to command applied, over all loops
+double MeanLoopLatency () {
+  double sum = 0;
+  uint64_t count = 0;
+  for (size_t i = 0; i < loopMetrics.size (); i++) {
+    sum += loopMetrics[i].loop.sum;
+    count += loopMetrics[i].loop.count;
+  }
+  return count ? sum / count : 0;
+}
+
+// Sampled after the controllers of the period have run, so the lag includes
+// their own work; a best-effort realtime scheduler never runs early, a
+// positive lag means the event loop fell behind.
+// one probe per loop group, at the start of each of its control periods
+void PacingProbe (int remaining, double interval) {
+  int64_t wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now () - pacingStart).count ();
+  pacingLag.push_back (wall - Simulator::Now ().GetTimeStep ());
+  if (remaining > 1) {
+    Simulator::Schedule (Seconds (interval), &PacingProbe, remaining - 1, interval);
+  }
+}
+
+int PacingOverruns () {
+  int overruns = 0;
+  for (size_t i = 0; i < pacingLag.size (); i++) {
+    overruns += pacingLag[i] > Seconds (realtimeTolerance).GetTimeStep ();
+  }
+  return overruns;
+}
+
+int64_t PacingMaxLag () {
+  return pacingLag.empty () ? 0 : *std::max_element (pacingLag.begin (), pacingLag.end ());
+}
+
+// runs from Simulator::Destroy ()
+void DumpLoopMetrics () {
+  if (metricsFile.empty ()) {
+    return;
+  }
+  std::ofstream out (metricsFile.c_str ());
+  out << "{\"loops\":[";
+  for (size_t i = 0; i < loopMetrics.size (); i++) {
+    const LoopMetrics &m = loopMetrics[i];
+    out << (i == 0 ? "" : ",") << "\n{\"controller\":" << m.controller << ",\"plant\":" << m.plant
+        << ",\"period\":" << m.period << ",\"channel\":" << m.channel << ",\"uplink\":";
+    m.uplink.WriteJson (out, pathTrie);
+    out << ",\"downlink\":";
+    m.downlink.WriteJson (out, pathTrie);
+    out << ",\"loop\":{\"deadline_misses\":" << m.loop_deadline_misses
+        << ",\"mean_abs_error\":" << (m.error_samples ? m.abs_error_sum / m.error_samples : 0)
+        << ",\"latency_us\":";
+    m.loop.WriteJson (out);
+    out << "},\"quantization\":{\"mean_abs\":" << (m.quant_samples ? m.quant_abs_sum / m.quant_samples : 0)
+        << ",\"max_abs\":" << m.quant_max << ",\"saturated\":" << m.quant_saturated << "}";
+    if (useEnergy) {
+      // relays are shared between loops: each loop lists the whole relay set it uses
+      const SourceRoute &route = _devices.SRN[m.controller];
+      int relays = 0;
+      double relayMj = 0, maxRelayMj = 0, minDays = std::min (energy.LifetimeDays (m.controller), energy.LifetimeDays (m.plant));
+      for (int n = 0; n < nodeSize; n++) {
+        if (_devices.node_role[n] == RELAY_NODE_ROLE && route.Contains (n)) {
+          relays++;
+          relayMj += energy.EnergyMj (n);
+          maxRelayMj = std::max (maxRelayMj, energy.EnergyMj (n));
+          minDays = std::min (minDays, energy.LifetimeDays (n));
+        }
+      }
+      out << ",\"energy\":{\"controller_mj\":" << energy.EnergyMj (m.controller) << ",\"plant_mj\":"
+          << energy.EnergyMj (m.plant) << ",\"relays\":" << relays << ",\"relay_mj\":" << relayMj
+          << ",\"max_relay_mj\":" << maxRelayMj << ",\"lifetime_days\":" << minDays << "}";
+    }
+    out << "}";
+  }
+  out << "\n],\"channels\":[";
+  double simS = Simulator::Now ().GetSeconds ();
+  for (int c = 0; c < channelCount; c++) {
+    ChannelStats &cs = channelStats[c];
+    cs.Advance (Simulator::Now ().GetTimeStep ());
+    uint64_t delivered = 0;
+    for (size_t i = 0; i < loopMetrics.size (); i++) {
+      if (loopMetrics[i].channel == FIRST_CHANNEL + c) {
+        delivered += loopMetrics[i].uplink.delivered + loopMetrics[i].downlink.delivered;
+      }
+    }
+    out << (c == 0 ? "" : ",") << "\n{\"channel\":" << FIRST_CHANNEL + c << ",\"loops\":" << cs.loops
+        << ",\"radios\":" << cs.radios << ",\"frames\":" << cs.frames << ",\"airtime_s\":" << cs.airtime
+        << ",\"utilization\":" << (simS > 0 ? cs.airtime / simS : 0) << ",\"concurrency\":" << cs.Concurrency ()
+        << ",\"max_concurrent\":" << cs.maxActive << ",\"delivered\":" << delivered << "}";
+  }
+  out << "\n],\"suppression\":{\"copies\":" << suppressCopies << ",\"cancelled\":" << suppressedRelays
+      << ",\"airtime_saved_s\":" << suppressedAirtime << ",\"delivery_ratio\":" << DeliveryRatio () << "}"
+      << ",\"aggregation\":{\"window\":" << aggregateWindow << ",\"frames\":" << aggregatedFrames
+      << ",\"samples\":" << aggregatedSamples << ",\"mean_delay_us\":"
+      << (aggregateDelaySamples ? aggregateDelaySum / 1000.0 / aggregateDelaySamples : 0)
+      << ",\"max_delay_us\":" << aggregateDelayMax / 1000.0 << ",\"airtime_saved_s\":" << aggregatedAirtime << "}";
+  if (txPowerControl) {
+    out << ",\"tx_power\":{\"margin_db\":" << txPowerMargin << ",\"min_dbm\":" << txPowerMinDbm << ",\"nodes\":[";
+    for (int n = 0; n < nodeSize; n++) {
+      out << (n == 0 ? "" : ",") << "\n{\"node\":" << n << ",\"dbm\":[";
+      for (size_t k = 0; k < txPowers[n].size (); k++) {
+        out << (k == 0 ? "" : ",") << txPowers[n][k];
+      }
+      out << "]}";
+    }
+    out << "\n]}";
+  }
+  if (useEnergy) {
+    energy.Settle ();
+    const char* roles[] = {"relay", "plant", "controller"};
+    out << ",\"energy\":{\"voltage\":" << energy.voltage << ",\"battery_mah\":" << energy.batteryMah << ",\"current_ma\":{";
+    for (int b = 0; b < EnergyMeter::BUCKETS; b++) {
+      out << (b == 0 ? "" : ",") << "\"" << EnergyMeter::Name (b) << "\":" << energy.current[b];
+    }
+    out << "},\"nodes\":[";
+    for (int n = 0; n < nodeSize; n++) {
+      const EnergyMeter::NodeEnergy &e = energy.nodes[n];
+      out << (n == 0 ? "" : ",") << "\n{\"node\":" << n << ",\"role\":\"" << roles[_devices.node_role[n]] << "\"";
+      for (int b = 0; b < EnergyMeter::BUCKETS; b++) {
+        out << ",\"" << EnergyMeter::Name (b) << "_s\":" << e.time[b] * 1e-9;
+      }
+      out << ",\"frames\":" << e.frames << ",\"sent\":" << e.sent << ",\"relayed\":" << e.relayed
+          << ",\"discarded\":" << e.discarded << ",\"energy_mj\":" << energy.EnergyMj (n)
+          << ",\"lifetime_days\":" << energy.LifetimeDays (n) << "}";
+    }
+    out << "\n]}";
+  }
+  if (useRealtime) {
+    out << ",\"realtime\":{\"tolerance_s\":" << realtimeTolerance << ",\"overruns\":" << PacingOverruns ()
+        << ",\"max_lag_us\":" << PacingMaxLag () / 1000.0 << ",\"lag_us\":[";
+    for (size_t i = 0; i < pacingLag.size (); i++) {
+      out << (i == 0 ? "" : ",") << pacingLag[i] / 1000.0;
+    }
+    out << "]}";
+  }
+  out << "}\n";
+}
+
+inline void Trace (int node, TraceEvent event, const PacketStructure &pkt) {
+  if (useEnergy) {
+    energy.Count (node, event);
+  }
+  if (tracer.IsOpen ()) {
+    tracer.Append (Simulator::Now ().GetTimeStep (), node, event, pkt.GetDsn (), pkt.payload);
+  }
+}
 
+void CloseCosim () {
+  if (cosim.steps > 0) {
+    std::cout << "cosim: " << cosim.steps << " steps, round trip mean " << cosim.stepNs / 1000.0 / cosim.steps
+              << " us max " << cosim.maxStepNs / 1000.0 << " us" << std::endl;
+  }
+  cosim.Close ();
+}
 
-#include <deque>
-#include <algorithm>
+void CloseTrace () {
+  tracer.Close ();
+}
 
-using namespace ns3;
+// Give every loop's controller the union of its planned relay paths as SRN
+// (the plant echoes the route back from the commands it receives).
+void PlanRoutes (Ptr<LinkGainCache> gains) {
+  SystemWallClockMs clock;
+  clock.Start ();
+  RoutePlanner planner;
+  loopRoutes.assign (loopMetrics.size (), std::vector<std::vector<uint16_t> > ());
+  std::vector<double> x (gains->GetN ()), y (gains->GetN ());
+  for (uint32_t i = 0; i < gains->GetN (); i++) {
+    Vector pos = mobilities[i]->GetPosition ();
+    x[i] = pos.x;
+    y[i] = pos.y;
+  }
+  planner.Build (gains, x, y, routeRange, routeTxPowerDbm, routeNoiseDbm, ROUTE_FRAME_BYTES, routeMinPrr);
+  std::cout << "route graph: " << planner.GetLinks () << " links, " << gains->GetEvaluated ()
+            << " link gains evaluated" << std::endl;
+  std::vector<uint8_t> endpoints (gains->GetN (), 0);
+  for (size_t l = 0; l < loopMetrics.size (); l++) {
+    endpoints[loopMetrics[l].controller] = 1;
+    endpoints[loopMetrics[l].plant] = 1;
+  }
 
-// CLASS SPACE =================================================================
-class PacketStructure {
-public:
-  uint32_t SRN;       // 4 bytes: set of path field
-  uint8_t dest_idx;   // 1 byte : destination index (before: direction)
-  uint8_t seq;        // 1 byte : sequence
-  double payload;     // 8 bytes: payload
+  for (size_t l = 0; l < loopMetrics.size (); l++) {
+    int ctrlIdx = loopMetrics[l].controller;
+    int plantIdx = loopMetrics[l].plant;
+    std::vector<std::vector<uint16_t> > paths;
+    double reliability = planner.Plan (ctrlIdx, plantIdx, routePaths, routeMaxHops, routeReliability, endpoints, paths);
+    NS_ABORT_MSG_IF (paths.empty (), "no route within " << routeMaxHops << " hops from " << ctrlIdx << " to " << plantIdx);
+
+    std::vector<uint16_t> hops;
+    std::cout << "route " << ctrlIdx << " -> " << plantIdx << " (p=" << reliability << "):";
+    for (size_t k = 0; k < paths.size (); k++) {
+      std::cout << (k == 0 ? " " : " | ");
+      for (size_t i = 0; i < paths[k].size (); i++) {
+        std::cout << (i == 0 ? "" : "-") << paths[k][i];
+      }
+      hops.insert (hops.end (), paths[k].begin (), paths[k].end ());
+    }
+    std::cout << std::endl;
+    std::sort (hops.begin (), hops.end ());
+    hops.erase (std::unique (hops.begin (), hops.end ()), hops.end ());
+    _devices.SRN[ctrlIdx].SetHops (hops.data (), hops.size ());
+    loopRoutes[l] = paths;
+  }
+  std::cout << "route planning took " << clock.End () << " ms" << std::endl;
+}
 
-  uint16_t GetDsn () {
-    return (static_cast<uint16_t>(dest_idx) *1000) + static_cast<uint16_t>(seq);
+// The radio of node idx tuned to channel ch; the primary one if it has none.
+Ptr<LrWpanNetDevice> RadioFor (int idx, int ch) {
+  const std::vector<std::pair<int, Ptr<LrWpanNetDevice> > > &radios = bridgeRadios[idx];
+  for (size_t k = 0; k < radios.size (); k++) {
+    if (radios[k].first == ch) {
+      return radios[k].second;
+    }
   }
-};
+  return devices[idx];
+}
 
-class DeviceStructure {
-public:
-  int node_role = 0;    // Default : RELAY_NODE_ROLE
-  int destination = -1;
+void SetTxPower (Ptr<LrWpanNetDevice> dev, int dbm) {
+  LrWpanPhyPibAttributes attr;
+  attr.phyTransmitPower = dbm & 0x3f;  // 6-bit two's complement, tolerance bits 0
+  dev->GetPhy ()->PlmeSetAttributeRequest (phyTransmitPower, &attr);
+}
 
-  double reference = 0;
+// Give every radio the lowest TX power (whole dBm, as the PHY PIB holds it)
+// at which each hop it sends over keeps TX_POWER_PRR with txPowerMargin to
+// spare: the next node of every planned path through it for commands, the
+// previous one for the echoes coming back. Radios on no path keep the
+// highest power, as all do with --txPowerControl off (a variant turning it
+// off). Power is only ever lowered, so gridMaxTxPowerDbm stays a bound for
+// the grid channel.
+void AssignTxPower () {
+  double snrDb = -8;
+  while (RoutePlanner::Prr (snrDb, ROUTE_FRAME_BYTES) < TX_POWER_PRR) {
+    snrDb += 0.1;
+  }
+  double rxDbm = std::max (routeNoiseDbm + snrDb, PHY_RX_SENSITIVITY_DBM) + txPowerMargin;
+  double maxDbm = std::min (routeTxPowerDbm, gridMaxTxPowerDbm);
+
+  std::unordered_map<const LrWpanNetDevice*, double> need;
+  for (size_t l = 0; l < loopRoutes.size () && txPowerControl; l++) {
+    int ch = loopMetrics[l].channel;
+    for (size_t k = 0; k < loopRoutes[l].size (); k++) {
+      const std::vector<uint16_t> &path = loopRoutes[l][k];
+      for (size_t i = 0; i + 1 < path.size (); i++) {
+        double down = rxDbm + routeGains->GetLoss (path[i], path[i + 1]);
+        double up = rxDbm + routeGains->GetLoss (path[i + 1], path[i]);
+        double &sender = need.insert (std::make_pair (PeekPointer (RadioFor (path[i], ch)), down)).first->second;
+        sender = std::max (sender, down);
+        double &receiver = need.insert (std::make_pair (PeekPointer (RadioFor (path[i + 1], ch)), up)).first->second;
+        receiver = std::max (receiver, up);
+      }
+    }
+  }
 
-  double U = 0;
-  double Y = 0;
+  txPowers.assign (nodeSize, std::vector<int> ());
+  int lowered = 0;
+  double sum = 0;
+  for (int n = 0; n < nodeSize; n++) {
+    std::vector<Ptr<LrWpanNetDevice> > radios (1, devices[n]);
+    for (size_t k = 0; k < bridgeRadios[n].size (); k++) {
+      radios.push_back (bridgeRadios[n][k].second);
+    }
+    for (size_t k = 0; k < radios.size (); k++) {
+      std::unordered_map<const LrWpanNetDevice*, double>::const_iterator it = need.find (PeekPointer (radios[k]));
+      int dbm = static_cast<int>(std::floor (maxDbm));
+      if (it != need.end ()) {
+        dbm = std::min (dbm, static_cast<int>(std::ceil (std::max (it->second, txPowerMinDbm))));
+        lowered += dbm < maxDbm;
+        sum += dbm;
+      }
+      SetTxPower (radios[k], dbm);
+      txPowers[n].push_back (dbm);
+    }
+  }
+  std::cout << "tx power: " << need.size () << " radios on routes, " << lowered << " lowered, mean "
+            << (need.empty () ? 0 : sum / need.size ()) << " dBm (margin " << txPowerMargin << " dB)" << std::endl;
+}
 
-  double X[3]   = {0,};
-  double X_t[3] = {0,};
+void PhyStateChange (int radio, Time now, LrWpanPhyEnumeration oldState, LrWpanPhyEnumeration newState) {
+  energy.StateChange (radio, newState);
+}
 
-  double error_sum  = 0;
-  double error_last = 0;
+void ChannelTxBegin (int ch, Ptr<const Packet> p) {
+  ChannelStats &cs = channelStats[ch - FIRST_CHANNEL];
+  double airtime = (p->GetSize () + PHY_OVERHEAD_BYTES) * 8 / PHY_BIT_RATE;
+  cs.frames++;
+  cs.airtime += airtime;
+  cs.TxBegin (Simulator::Now ().GetTimeStep (), Seconds (airtime).GetTimeStep ());
+}
 
-  std::deque<uint16_t> DSN_Queue;
+uint64_t SlotKey (int node, int loop, bool uplink) {
+  return (static_cast<uint64_t>(node) << 32) | (static_cast<uint64_t>(loop) << 1) | uplink;
+}
 
-  uint32_t SRN = 0;
-  uint8_t seq  = 0;
+// WirelessHART-style superframe, one control period long. Downlink slots
+// start with the period (when controllers sample), uplink slots half a
+// period later (when plants do). Within a half, the loops of a channel follow
+// each other, each with its source and then its relays by hop count from that
+// source: a sample crosses the relay set within the half period and no two
+// radios on one channel ever share a slot.
+void BuildSuperframe () {
+  NS_ABORT_MSG_IF (loopGroups.size () != 1, "--tdma needs the same period for every loop");
+  superframeTs = Seconds (loopGroups[0].interval).GetTimeStep ();
+  int64_t slotTs = Seconds (slotLength).GetTimeStep ();
+  tdmaSlots.clear ();
+  std::vector<int> used (2 * channelCount, 0);  // slots taken per (half, channel)
+  for (size_t l = 0; l < loopMetrics.size (); l++) {
+    const LoopMetrics &m = loopMetrics[l];
+    for (int uplink = 0; uplink < 2; uplink++) {
+      std::map<int, int> depth;  // relay -> fewest hops from the source
+      for (size_t k = 0; k < loopRoutes[l].size (); k++) {
+        const std::vector<uint16_t> &path = loopRoutes[l][k];
+        for (size_t i = 1; i + 1 < path.size (); i++) {
+          int d = uplink ? path.size () - 1 - i : i;
+          std::map<int, int>::iterator it = depth.find (path[i]);
+          if (it == depth.end () || d < it->second) {
+            depth[path[i]] = d;
+          }
+        }
+      }
+      std::vector<std::pair<int, int> > order;  // (hops, relay)
+      for (std::map<int, int>::iterator it = depth.begin (); it != depth.end (); ++it) {
+        order.push_back (std::make_pair (it->second, it->first));
+      }
+      std::sort (order.begin (), order.end ());
+
+      int &n = used[uplink * channelCount + m.channel - FIRST_CHANNEL];
+      int64_t base = uplink ? superframeTs / 2 : 0;
+      tdmaSlots[SlotKey (uplink ? m.plant : m.controller, l, uplink)] = base + n++ * slotTs;
+      for (size_t i = 0; i < order.size (); i++) {
+        tdmaSlots[SlotKey (order[i].second, l, uplink)] = base + n++ * slotTs;
+      }
+    }
+  }
 
-  bool rxTrigger = false;
-};
-// END CLASS SPACE =============================================================
+  int most = *std::max_element (used.begin (), used.end ());
+  NS_ABORT_MSG_IF (most * slotTs > superframeTs / 2,
+                   "superframe needs " << most << " slots of " << slotLength * 1000 << " ms per half period:"
+                   " use more --channels, a shorter --slotLength or a longer --period");
+  std::cout << "tdma: " << tdmaSlots.size () << " slots, at most " << most << " of "
+            << superframeTs / 2 / slotTs << " per half period on one channel" << std::endl;
+}
 
-// CONTSTANT ===================================================================
-const int PLANT_SIZE                 = 1;
-const int NODE_SIZE                  = 23;
-const int CONTROLLER_ROLE            = 2;
-const int PLANT_ROLE                 = 1;
-const int RELAY_NODE_ROLE            = 0;
-// const uint8_t CONTROLLER_DIRECTION   = 0;
-// const uint8_t PLANT_DIRECTION        = 1;
-// END CONTSTANT ===============================================================
+// Hand a frame to the MAC: at once, or with --tdma in the sender's next slot
+// for this loop and direction. Nodes without a slot stay silent.
+void MacSend (Ptr<LrWpanNetDevice> dev, Ptr<Packet> p, int node, int loop, bool uplink) {
+  PROFILE_SCOPE ("MacSend");
+  if (!useTdma) {
+    dev->GetMac ()->McpsDataRequest (txParams, p);
+    return;
+  }
+  std::unordered_map<uint64_t, int64_t>::const_iterator it = tdmaSlots.find (SlotKey (node, loop, uplink));
+  if (it == tdmaSlots.end ()) {
+    return;
+  }
+  int64_t now = Simulator::Now ().GetTimeStep ();
+  int64_t wait = ((it->second - now % superframeTs) % superframeTs + superframeTs) % superframeTs;
+  Simulator::Schedule (TimeStep (wait), &LrWpanMac::McpsDataRequest, dev->GetMac (), txParams, p);
+}
 
-Ptr<Node> nodes[NODE_SIZE];
-Ptr<LrWpanNetDevice> devices[NODE_SIZE];
-Ptr<MobilityModel> mobilities[NODE_SIZE];
-Ptr<MobilityBuildingInfo> buildingInfos[NODE_SIZE];
+bool IsDuplicate (int idx, uint32_t dsn) {
+  PROFILE_SCOPE ("IsDuplicate");
+  return _devices.DSN_Table[idx].Contains (dsn, Simulator::Now ().GetTimeStep ());
+}
 
-DeviceStructure _devices[NODE_SIZE];
+void MarkSeen (int idx, uint32_t dsn) {
+  _devices.DSN_Table[idx].Insert (dsn, Simulator::Now ().GetTimeStep (), Seconds (dsnWindow).GetTimeStep ());
+}
 
-double Kp = 0;
-double Ki = 0;
-double Kd = 0;
+// Size every duplicate table for the DSNs its node can hold within
+// dsnWindow: each loop routed through the node adds one sample per period
+// in each direction. Without a route yet, a loop takes the fixed one.
+void SizeDsnTables () {
+  std::vector<int> entries (nodeSize, 0);
+  std::vector<uint16_t> hops;
+  for (size_t l = 0; l < loopMetrics.size (); l++) {
+    const LoopMetrics &m = loopMetrics[l];
+    hops.clear ();
+    if (_devices.SRN[m.controller].Empty ()) {
+      hops.push_back (m.controller);
+      hops.insert (hops.end (), FIXED_ROUTE, FIXED_ROUTE + FIXED_ROUTE_HOPS);
+      hops.push_back (m.plant);
+    } else {
+      _devices.SRN[m.controller].AppendHops (hops);
+    }
+    int perLoop = 2 * static_cast<int>(std::ceil (dsnWindow / m.period)) + 2;
+    for (size_t h = 0; h < hops.size (); h++) {
+      entries[hops[h]] += perLoop;
+    }
+  }
+  int64_t now = Simulator::Now ().GetTimeStep ();
+  for (int i = 0; i < nodeSize; i++) {
+    _devices.DSN_Table[i].Reserve (entries[i], now);
+  }
+}
 
-double _A[9] = {0,};
-double _B[3] = {0,};
-double _C[3] = {0,};
+void TxPacket (int devIdx, const SourceRoute &SRN, uint16_t dest_idx, uint8_t seq, double payload) {
+  PROFILE_SCOPE ("TxPacket");
+  const FrameCodec &codec = FrameCodec::Get ();
+  if (codec.GetEncoding () != FrameCodec::FULL) {
+    bool saturated;
+    double error = std::fabs (codec.Quantize (dest_idx, payload, saturated) - payload);
+    LoopMetrics &m = loopMetrics[_devices.loop[devIdx]];
+    m.quant_abs_sum += error;
+    m.quant_max = std::max (m.quant_max, error);
+    m.quant_samples++;
+    m.quant_saturated += saturated;
+    seq &= codec.SeqMask ();  // what goes on air, so the own DSN matches the echoes
+  }
+  PacketStructure pkt_form (SRN, dest_idx, seq, payload);
+  Ptr<Packet> pkt = Create<Packet> ();
+  pkt->AddHeader (pkt_form);
+  RecordTx (devIdx, pkt);
+
+  MacSend (devices[devIdx], pkt, devIdx, _devices.loop[devIdx], _devices.node_role[devIdx] == PLANT_ROLE);  // tx
+  MarkSeen (devIdx, pkt_form.GetDsn());
+  Trace (devIdx, TRACE_TX, pkt_form);
+}
 
-McpsDataRequestParams txParams;
-// std::deque<uint16_t> DSN_Queue[NODE_SIZE];
+void FlushRelayQueue (int myIdx, int ch, bool uplink) {
+  PROFILE_SCOPE ("FlushRelayQueue");
+  RelayQueue &q = relayQueues[std::make_tuple (myIdx, ch, uplink)];
+  q.flush.Cancel ();
+  if (q.samples.empty ()) {
+    return;
+  }
+  int64_t now = Simulator::Now ().GetTimeStep ();
+  for (size_t i = 0; i < q.enqueued.size (); i++) {
+    aggregateDelaySum += now - q.enqueued[i];
+    aggregateDelayMax = std::max (aggregateDelayMax, now - q.enqueued[i]);
+  }
+  aggregateDelaySamples += q.samples.size ();
+
+  Ptr<Packet> frame = q.samples[0];
+  if (q.samples.size () > 1) {
+    // the LoopTags travel as byte tags so each stays with its own sample
+    frame = Create<Packet> ();
+    for (size_t i = 0; i < q.samples.size (); i++) {
+      LoopTag tag;
+      if (q.samples[i]->RemovePacketTag (tag)) {
+        q.samples[i]->AddByteTag (tag);
+      }
+      frame->AddAtEnd (q.samples[i]);
+    }
+    AggregateHeader header;
+    header.count = q.samples.size ();
+    frame->AddHeader (header);
+    aggregatedFrames++;
+    aggregatedSamples += q.samples.size ();
+    aggregatedAirtime += (q.samples.size () - 1) * (MAC_OVERHEAD_BYTES + PHY_OVERHEAD_BYTES) * 8 / PHY_BIT_RATE
+                         - header.GetSerializedSize () * 8 / PHY_BIT_RATE;
+  }
+  q.samples.clear ();
+  q.enqueued.clear ();
+  q.bytes = 0;
+  MacSend (RadioFor (myIdx, ch), frame, myIdx, q.loop, uplink);  // tx
+}
+
+void QueueRelay (int myIdx, int ch, int loop, bool uplink, Ptr<Packet> p) {
+  RelayQueue &q = relayQueues[std::make_tuple (myIdx, ch, uplink)];
+  AggregateHeader header;
+  if (!q.samples.empty () && header.GetSerializedSize () + q.bytes + p->GetSize () > static_cast<uint32_t>(MAX_MSDU_BYTES)) {
+    FlushRelayQueue (myIdx, ch, uplink);
+  }
+  if (q.samples.empty ()) {
+    q.loop = loop;
+  }
+  q.samples.push_back (p);
+  q.enqueued.push_back (Simulator::Now ().GetTimeStep ());
+  q.bytes += p->GetSize ();
+  if (q.samples.size () == 1) {
+    q.flush = Simulator::Schedule (Seconds (aggregateWindow), &FlushRelayQueue, myIdx, ch, uplink);
+  }
+}
 
-uint32_t TriggerNode(int node_number) {
-  return 1 << (node_number);
+void ForwardRelay (int myIdx, Ptr<Packet> p, const PacketStructure &pkt) {
+  PROFILE_SCOPE ("ForwardRelay");
+  RecordRelay (myIdx, p);
+  int loop = _devices.loop[pkt.dest_idx];
+  bool uplink = _devices.node_role[pkt.dest_idx] == CONTROLLER_ROLE;
+  if (aggregateWindow > 0) {
+    QueueRelay (myIdx, loopMetrics[loop].channel, loop, uplink, p);
+  } else {
+    MacSend (RadioFor (myIdx, loopMetrics[loop].channel), p, myIdx, loop, uplink); // tx
+  }
+  Trace (myIdx, TRACE_RELAY, pkt);
 }
 
-static void dequeue_handler (int idx) {
-  _devices[idx].DSN_Queue.pop_front();
-  // std::cout << "[" << Simulator::Now ().GetSeconds () << "] dequeue device " << idx << std::endl;
-  // std::cout << "dequeue_handler: " << Simulator::Now ().GetSeconds () << " " << _devices[idx].DSN_Queue.size() << std::endl;
+uint64_t RelayKey (int myIdx, uint32_t dsn) {
+  return (static_cast<uint64_t>(myIdx) << 32) | dsn;
 }
 
-void TxPacket (int devIdx, uint32_t SRN, uint8_t dest_idx, uint8_t seq, double payload) {
-  PacketStructure pkt_form = {SRN, dest_idx, seq, payload};
-  uint8_t* serialized_pkt = static_cast<uint8_t*>(static_cast<void*>(&pkt_form));
-  Ptr<Packet> pkt = Create<Packet> (serialized_pkt, sizeof(pkt_form));
+void DelayedRelay (int myIdx, Ptr<Packet> p) {
+  PacketStructure pkt;
+  p->PeekHeader (pkt);
+  pendingRelays.erase (RelayKey (myIdx, pkt.GetDsn ()));
+  ForwardRelay (myIdx, p, pkt);
+}
 
-  devices[devIdx]->GetMac ()->McpsDataRequest (txParams, pkt);  // tx
-  _devices[devIdx].DSN_Queue.push_back(pkt_form.GetDsn());  // enqueue
-  // std::cout << "[" << Simulator::Now ().GetSeconds () << "] enqueue device " << devIdx << std::endl;
-  Simulator::Schedule(Seconds(1), &dequeue_handler, devIdx); // dequeue
+// another copy of a DSN this relay is about to forward
+void HeardCopy (int myIdx, int srcIdx, Ptr<Packet> p, const PacketStructure &pkt) {
+  std::unordered_map<uint64_t, PendingRelay>::iterator it = pendingRelays.find (RelayKey (myIdx, pkt.GetDsn ()));
+  if (it == pendingRelays.end () ||
+      mobilities[srcIdx]->GetDistanceFrom (mobilities[pkt.dest_idx]) >=
+      mobilities[myIdx]->GetDistanceFrom (mobilities[pkt.dest_idx])) {
+    return;
+  }
+  if (++it->second.copies >= suppressCopies) {
+    it->second.event.Cancel ();
+    pendingRelays.erase (it);
+    suppressedRelays++;
+    suppressedAirtime += (p->GetSize () + MAC_OVERHEAD_BYTES + PHY_OVERHEAD_BYTES) * 8 / PHY_BIT_RATE;
+    Trace (myIdx, TRACE_SUPPRESS, pkt);
+  }
 }
 
 static void RelayDeviceRxCallback (McpsDataIndicationParams rxParams, Ptr<Packet> p)
 {
-  // NS_LOG_UNCOND ("Received from " << rxParams.m_srcAddr << " to " << rxParams.m_dstAddr << " packet of size " << p->GetSize ());
-
-  // deserialize the received packet: convert <Packet> to <PacketStructure> form
-  uint8_t* serialized_pkt = new uint8_t[p->GetSize ()];
-  p->CopyData (serialized_pkt, p->GetSize ());
-  PacketStructure pkt = *reinterpret_cast<PacketStructure *>(serialized_pkt);
-  // std::cout << pkt.SRN << std::endl;
-  // std::cout << static_cast<int>(pkt.direction) << std::endl;
-  // std::cout << static_cast<int>(pkt.seq) << std::endl;
-  // std::cout << pkt.payload << std::endl;
+  PROFILE_SCOPE ("RelayDeviceRxCallback");
+  // deserialize the received packet: peek <PacketStructure> without consuming it
+  PacketStructure pkt;
+  p->PeekHeader (pkt);
 
   // Get my index
-  uint8_t myAddr[2];  // if 00:01, [0] = 00 and [1] = 01
-  rxParams.m_dstAddr.CopyTo (myAddr);
-  int myIdx = myAddr[1];
-
-  uint32_t pick = 1;
-  uint16_t dsn = pkt.GetDsn();
-  if (((pkt.SRN & (pick << myIdx)) == (pick << myIdx)) &&     // I'm a relay node of this packet
-      (std::find(_devices[myIdx].DSN_Queue.begin(), _devices[myIdx].DSN_Queue.end(), dsn) == _devices[myIdx].DSN_Queue.end())) { // doesn't eixst the DSN
-    devices[myIdx]->GetMac ()->McpsDataRequest (txParams, p); // tx
-    _devices[myIdx].DSN_Queue.push_back(dsn);  // enqueue
-    // std::cout << "[" << Simulator::Now ().GetSeconds () << "] enqueue device " << myIdx << std::endl;
-    Simulator::Schedule(Seconds(1), &dequeue_handler, myIdx); // dequeue
-    // std::cout<<static_cast<int>(_devices[myIdx].DSN_Queue.front())<<std::endl;
-    // std::cout << "hi" << static_cast<int>(myIdx) << std::endl;
-    // std::cout << "before: " << Simulator::Now ().GetSeconds () << std::endl;
-
-    // std::cout << "[" << Simulator::Now ().GetSeconds () << "] " << myIdx << " relay " << rxParams.m_srcAddr << " -> " << rxParams.m_dstAddr << " -> broadcast " << std::endl;
+  int myIdx = GetNodeIndex (rxParams.m_dstAddr);
+
+  uint32_t dsn = pkt.GetDsn();
+  if (pkt.SRN.Contains (myIdx) &&     // I'm a relay node of this packet
+      !IsDuplicate (myIdx, dsn)) { // doesn't eixst the DSN
+    MarkSeen (myIdx, dsn);
+    if (suppressCopies > 0) {
+      pendingRelays[RelayKey (myIdx, dsn)].event =
+        Simulator::Schedule (Seconds (suppressJitter->GetValue (0, suppressDelay)), &DelayedRelay, myIdx, p);
+    } else {
+      ForwardRelay (myIdx, p, pkt);
+    }
   } else {
-    // std::cout << "[" << Simulator::Now ().GetSeconds () << "] " << myIdx << " discard " << rxParams.m_srcAddr << " -> " << rxParams.m_dstAddr << " ";
-    // if (((pkt.SRN & (pick << myIdx)) != (pick << myIdx))) {
-    //   std::cout << "[NOT MINE]" << std::endl;
-    // } else if ((std::find(_devices[myIdx].DSN_Queue.begin(), _devices[myIdx].DSN_Queue.end(), dsn) != _devices[myIdx].DSN_Queue.end())) {
-    //   std::cout << "[DSN]" << std::endl;
-    // }
+    Trace (myIdx, pkt.SRN.Contains (myIdx) ? TRACE_DISCARD_DUPLICATE : TRACE_DISCARD_NOT_MINE, pkt);
+    if (suppressCopies > 0 && pkt.SRN.Contains (myIdx)) {
+      HeardCopy (myIdx, GetNodeIndex (rxParams.m_srcAddr), p, pkt);
+    }
   }
 }
 
 static void ControllerRxCallback (McpsDataIndicationParams rxParams, Ptr<Packet> p)
 {
-  // deserialize the received packet: convert <Packet> to <PacketStructure> form
-  uint8_t* serialized_pkt = new uint8_t[p->GetSize ()];
-  p->CopyData (serialized_pkt, p->GetSize ());
-  PacketStructure pkt = *reinterpret_cast<PacketStructure *>(serialized_pkt);
+  PROFILE_SCOPE ("ControllerRxCallback");
+  // deserialize the received packet: peek <PacketStructure> without consuming it
+  PacketStructure pkt;
+  p->PeekHeader (pkt);
 
   // Get my index
-  uint8_t myAddr[2];  // if 00:01, [0] = 00 and [1] = 01
-  rxParams.m_dstAddr.CopyTo (myAddr);
-  int myIdx = myAddr[1];
-
-  uint32_t pick = 1;
-  uint16_t dsn = pkt.GetDsn();
-  if (((pkt.SRN & (pick << myIdx)) == (pick << myIdx)) &&     // I'm a relay node of this packet
-      (std::find(_devices[myIdx].DSN_Queue.begin(), _devices[myIdx].DSN_Queue.end(), dsn) == _devices[myIdx].DSN_Queue.end())) { // doesn't eixst the DSN
-    _devices[myIdx].Y = pkt.payload;
-    _devices[myIdx].DSN_Queue.push_back(dsn);  // enqueue
-    Simulator::Schedule(Seconds(1), &dequeue_handler, myIdx); // dequeue
-
-    // std::cout << "[" << Simulator::Now ().GetSeconds () << "] Rx Controller ["  << myIdx << "]: " << pkt.payload << std::endl;
-    if (myIdx == 2)
-      std::cout << pkt.payload << std::endl;
+  int myIdx = GetNodeIndex (rxParams.m_dstAddr);
+
+  uint32_t dsn = pkt.GetDsn();
+  bool mine = pkt.dest_idx == myIdx && pkt.SRN.Contains (myIdx);  // not another loop's sample on a shared route
+  if (mine &&
+      !IsDuplicate (myIdx, dsn)) { // doesn't eixst the DSN
+    loopGroups[_devices.group[myIdx]].controllers.Y[_devices.slot[myIdx]] = pkt.payload;
+    MarkSeen (myIdx, dsn);
+    RecordDelivery (myIdx, p);
+    Trace (myIdx, TRACE_DELIVER, pkt);
   } else {
-    // std::cout << "[" << Simulator::Now ().GetSeconds () << "] " << myIdx << " discard " << rxParams.m_srcAddr << " -> " << rxParams.m_dstAddr << " ";
-    // if (((pkt.SRN & (pick << myIdx)) != (pick << myIdx))) {
-    //   std::cout << "[NOT MINE]" << std::endl;
-    // } else if ((std::find(_devices[myIdx].DSN_Queue.begin(), _devices[myIdx].DSN_Queue.end(), dsn) != _devices[myIdx].DSN_Queue.end())) {
-    //   std::cout << "[DSN]" << std::endl;
-    // }
+    if (mine) {  // a later copy of a sample already delivered
+      RecordDuplicate (myIdx);
+    }
+    Trace (myIdx, mine ? TRACE_DISCARD_DUPLICATE : TRACE_DISCARD_NOT_MINE, pkt);
+  }
+}
+
+void SetTriggerMode () {
+  const char* triggerNames[] = {"periodic", "absolute", "relative", "state"};
+  const char** trigger = std::find (triggerNames, triggerNames + 4, triggerMode);
+  NS_ABORT_MSG_IF (trigger == triggerNames + 4, "--trigger must be periodic, absolute, relative or state");
+  sendTrigger = static_cast<SendTrigger>(trigger - triggerNames);
+}
+
+bool ShouldSend (int idx, double value, double state) {
+  int64_t now = Simulator::Now ().GetTimeStep ();
+  bool send = sendTrigger == TRIGGER_PERIODIC || _devices.lastSentTs[idx] < 0 ||
+              now - _devices.lastSentTs[idx] >= Seconds (heartbeat).GetTimeStep ();
+  double change = std::fabs (value - _devices.lastSent[idx]);
+  if (!send) {
+    switch (sendTrigger) {
+    case TRIGGER_ABSOLUTE: send = change > triggerThreshold; break;
+    case TRIGGER_RELATIVE: send = change > triggerThreshold * std::fabs (_devices.lastSent[idx]); break;
+    case TRIGGER_STATE:    send = change > triggerThreshold * state; break;
+    default: break;
+    }
+  }
+  if (send) {
+    _devices.lastSent[idx] = value;
+    _devices.lastSentTs[idx] = now;
   }
+  return send;
 }
 
-void ControllerTxCallback (int cycle, double interval, int myIdx) {
+void ControllerTxCallback (int cycle, double interval, int group) {
+  PROFILE_SCOPE ("ControllerTxCallback");
   if (cycle < 0) {
+    loopGroups[group].controllerCycle = -1;
     return;
   }
 
-  // Calculate plant
-  double error = _devices[myIdx].reference - _devices[myIdx].Y;
-  double U = Kp * error + Ki * _devices[myIdx].error_sum + Kd * ((error - _devices[myIdx].error_last) / 0.2);
-  _devices[myIdx].error_sum += error * 0.2;
-  _devices[myIdx].error_last = error;
-
-  int destIdx = _devices[myIdx].destination;
-
-  // uint32_t path = TriggerNode(myIdx) +
-  //                  TriggerNode(3) +
-  //                  TriggerNode(8) +
-  //                  TriggerNode(14) +
-  //                  TriggerNode(16) +
-  //                  TriggerNode(21) +
-  //                  TriggerNode(22) +
-  //                  TriggerNode(destIdx);
-
-  uint32_t path = TriggerNode(myIdx) +
-                   TriggerNode(3) +
-                   TriggerNode(9) +
-                   TriggerNode(15) +
-                   TriggerNode(6) +
-                   TriggerNode(17) +
-                   TriggerNode(20) +
-                   TriggerNode(destIdx);
-
-  // uint32_t path = TriggerNode(myIdx) +
-  //                  TriggerNode(4) +
-  //                  TriggerNode(2) +
-  //                  TriggerNode(10) +
-  //                  TriggerNode(12) +
-  //                  TriggerNode(16) +
-  //                  TriggerNode(17) +
-  //                  TriggerNode(20) +
-  //                  TriggerNode(destIdx);
-
-  // uint32_t path = TriggerNode(myIdx) +
-  //                  TriggerNode(5) +
-  //                  TriggerNode(11) +
-  //                  TriggerNode(13) +
-  //                  TriggerNode(19) +
-  //                  TriggerNode(21) +
-  //                  TriggerNode(22) +
-  //                  TriggerNode(destIdx);
-
-  // uint32_t path = TriggerNode(myIdx) +
-  //                  TriggerNode(6) +
-  //                  TriggerNode(7) +
-  //                  TriggerNode(18) +
-  //                  TriggerNode(destIdx);
-
-  // Tx a packet
-  _devices[myIdx].SRN = path;
-  _devices[myIdx].seq++;
-
-  TxPacket(myIdx, _devices[myIdx].SRN, _devices[myIdx].destination, _devices[myIdx].seq, U);
-
-  // std::cout << myIdx << " Controller TX [" << Simulator::Now ().GetSeconds () << "]" << cycle << " times /// " << U << " " << _devices[myIdx].Y << std::endl;
-  Simulator::Schedule(Seconds(interval), &ControllerTxCallback, cycle-1, interval, myIdx);
+  // Calculate controllers
+  PidBank &ctrl = loopGroups[group].controllers;
+  {
+    PROFILE_SCOPE ("PidBank::Step");
+    ctrl.Step ();
+  }
+
+  for (int k = 0; k < ctrl.Size (); k++) {
+    int myIdx = ctrl.node[k];
+    LoopMetrics &m = loopMetrics[_devices.loop[myIdx]];
+    m.abs_error_sum += std::fabs (ctrl.error_last[k]);
+    m.error_samples++;
+    if (!plannedRoutes && !scenario.HasRoutes ()) {
+      uint16_t me = myIdx;
+      uint16_t destIdx = _devices.destination[myIdx];
+      uint16_t path[FIXED_ROUTE_HOPS + 2] = {me};
+      std::copy (FIXED_ROUTE, FIXED_ROUTE + FIXED_ROUTE_HOPS, path + 1);
+      path[FIXED_ROUTE_HOPS + 1] = destIdx;
+      _devices.SRN[myIdx].SetHops (path, sizeof (path) / sizeof (path[0]));
+    }
+
+    if (!ShouldSend (myIdx, ctrl.U[k], std::fabs (ctrl.error_last[k]))) {
+      m.downlink.skipped++;
+      continue;
+    }
+
+    // Tx a packet
+    _devices.seq[myIdx]++;
+
+    TxPacket(myIdx, _devices.SRN[myIdx], _devices.destination[myIdx], _devices.seq[myIdx], ctrl.U[k]);
+  }
+
+  loopGroups[group].controllerCycle = cycle - 1;
+  loopGroups[group].controllerNextTs = (Simulator::Now () + Seconds (interval)).GetTimeStep ();
+  Simulator::Schedule(Seconds(interval), &ControllerTxCallback, cycle-1, interval, group);
 }
 
 static void PlantRxCallback (McpsDataIndicationParams rxParams, Ptr<Packet> p)
 {
-  // deserialize the received packet: convert <Packet> to <PacketStructure> form
-  uint8_t* serialized_pkt = new uint8_t[p->GetSize ()];
-  p->CopyData (serialized_pkt, p->GetSize ());
-  PacketStructure pkt = *reinterpret_cast<PacketStructure *>(serialized_pkt);
+  PROFILE_SCOPE ("PlantRxCallback");
+  // deserialize the received packet: peek <PacketStructure> without consuming it
+  PacketStructure pkt;
+  p->PeekHeader (pkt);
 
   // Get my index
-  uint8_t myAddr[2];  // if 00:01, [0] = 00 and [1] = 01
-  rxParams.m_dstAddr.CopyTo (myAddr);
-  int myIdx = myAddr[1];
-
-  uint32_t pick = 1;
-  uint16_t dsn = pkt.GetDsn();
-  if (((pkt.SRN & (pick << myIdx)) == (pick << myIdx)) &&     // I'm a relay node of this packet
-      (std::find(_devices[myIdx].DSN_Queue.begin(), _devices[myIdx].DSN_Queue.end(), dsn) == _devices[myIdx].DSN_Queue.end())) { // doesn't eixst the DSN
-    _devices[myIdx].U = pkt.payload;
-    _devices[myIdx].DSN_Queue.push_back(dsn);  // enqueue
-    Simulator::Schedule(Seconds(1), &dequeue_handler, myIdx); // dequeue
-    _devices[myIdx].SRN = pkt.SRN;
-    _devices[myIdx].seq = pkt.seq;
-    _devices[myIdx].rxTrigger = true;
-
-    // std::cout << "[" << Simulator::Now ().GetSeconds () << "] Rx Plant ["  << myIdx << "]: " << pkt.payload << std::endl;
+  int myIdx = GetNodeIndex (rxParams.m_dstAddr);
+
+  uint32_t dsn = pkt.GetDsn();
+  bool mine = pkt.dest_idx == myIdx && pkt.SRN.Contains (myIdx);  // not another loop's sample on a shared route
+  if (mine &&
+      !IsDuplicate (myIdx, dsn)) { // doesn't eixst the DSN
+    loopGroups[_devices.group[myIdx]].plants.U[_devices.slot[myIdx]] = pkt.payload;
+    MarkSeen (myIdx, dsn);
+    RecordDelivery (myIdx, p);
+    Trace (myIdx, TRACE_DELIVER, pkt);
+    _devices.SRN[myIdx] = pkt.SRN;
+    _devices.seq[myIdx] = pkt.seq;
+    _devices.rxTrigger[myIdx] = true;
   } else {
-    // std::cout << "[" << Simulator::Now ().GetSeconds () << "] " << myIdx << " discard " << rxParams.m_srcAddr << " -> " << rxParams.m_dstAddr << " ";
-    // if (((pkt.SRN & (pick << myIdx)) != (pick << myIdx))) {
-    //   std::cout << "[NOT MINE]" << std::endl;
-    // } else if ((std::find(_devices[myIdx].DSN_Queue.begin(), _devices[myIdx].DSN_Queue.end(), dsn) != _devices[myIdx].DSN_Queue.end())) {
-    //   std::cout << "[DSN]" << std::endl;
-    // }
+    if (mine) {  // a later copy of a sample already delivered
+      RecordDuplicate (myIdx);
+    }
+    Trace (myIdx, mine ? TRACE_DISCARD_DUPLICATE : TRACE_DISCARD_NOT_MINE, pkt);
+  }
+}
+
+// With aggregation on every radio delivers through here: aggregated frames
+// are split back into samples, each handed to the node's own callback.
+static void AggregateRxCallback (McpsDataIndicationParams rxParams, Ptr<Packet> p)
+{
+  PROFILE_SCOPE ("AggregateRxCallback");
+  int myIdx = GetNodeIndex (rxParams.m_dstAddr);
+  void (*deliver) (McpsDataIndicationParams, Ptr<Packet>) = &RelayDeviceRxCallback;
+  if (_devices.node_role[myIdx] == CONTROLLER_ROLE) {
+    deliver = &ControllerRxCallback;
+  } else if (_devices.node_role[myIdx] == PLANT_ROLE) {
+    deliver = &PlantRxCallback;
+  }
+  if (!AggregateHeader::IsAggregate (p)) {
+    deliver (rxParams, p);
+    return;
+  }
+
+  Ptr<Packet> rest = p->Copy ();
+  AggregateHeader header;
+  rest->RemoveHeader (header);
+  for (int i = 0; i < header.count && rest->GetSize () > 0; i++) {
+    PacketStructure pkt;
+    rest->PeekHeader (pkt);
+    Ptr<Packet> sample = rest->CreateFragment (0, pkt.GetSerializedSize ());
+    rest->RemoveAtStart (pkt.GetSerializedSize ());
+    LoopTag tag;
+    if (sample->FindFirstMatchingByteTag (tag)) {
+      sample->RemoveAllByteTags ();
+      sample->AddPacketTag (tag);
+    }
+    deliver (rxParams, sample);
   }
 }
 
-void PlantTxCallback (int cycle, double interval, int myIdx) {
+void PlantTxCallback (int cycle, double interval, int group) {
+  PROFILE_SCOPE ("PlantTxCallback");
   if (cycle < 0) {
+    loopGroups[group].plantCycle = -1;
     return;
   }
 
-  // Calculate plant
-  double Y = _C[0] * _devices[myIdx].X[0] + _C[1] * _devices[myIdx].X[1] + _C[2] * _devices[myIdx].X[2];
+  // Calculate plants
+  PlantBank<PLANT_ORDER> &plant = loopGroups[group].plants;
+  if (cosim.IsOpen ()) {
+    std::vector<int> loops (plant.Size ());
+    for (int k = 0; k < plant.Size (); k++) {
+      loops[k] = _devices.loop[plant.node[k]];
+    }
+    PROFILE_SCOPE ("CosimBridge::Step");
+    cosim.Step (Simulator::Now ().GetTimeStep (), loops, plant.U, plant.Y);
+  } else {
+    PROFILE_SCOPE ("PlantBank::Step");
+    plant.Step ();
+  }
 
-  _devices[myIdx].X_t[0] = _A[0] * _devices[myIdx].X[0] + _A[1] * _devices[myIdx].X[1] + _A[2] * _devices[myIdx].X[2] + _B[0] * _devices[myIdx].U;
-  _devices[myIdx].X_t[1] = _A[3] * _devices[myIdx].X[0] + _A[4] * _devices[myIdx].X[1] + _A[5] * _devices[myIdx].X[2] + _B[1] * _devices[myIdx].U;
-  _devices[myIdx].X_t[2] = _A[6] * _devices[myIdx].X[0] + _A[7] * _devices[myIdx].X[1] + _A[8] * _devices[myIdx].X[2] + _B[2] * _devices[myIdx].U;
+  for (int k = 0; k < plant.Size (); k++) {
+    int myIdx = plant.node[k];
 
-  _devices[myIdx].X[0] = _devices[myIdx].X_t[0];
-  _devices[myIdx].X[1] = _devices[myIdx].X_t[1];
-  _devices[myIdx].X[2] = _devices[myIdx].X_t[2];
+    double norm = cosim.IsOpen () ? plant.Y[k] * plant.Y[k] : 0;  // external plants only show y
+    for (int i = 0; i < PLANT_ORDER; i++) {
+      norm += plant.X[i][k] * plant.X[i][k];
+    }
+    if (!ShouldSend (myIdx, plant.Y[k], std::sqrt (norm))) {
+      loopMetrics[_devices.loop[myIdx]].uplink.skipped++;
+      continue;
+    }
 
-  // Tx a packet
-  if (_devices[myIdx].rxTrigger == false) {
-    _devices[myIdx].seq++;
+    // Tx a packet
+    if (_devices.rxTrigger[myIdx] == false) {
+      _devices.seq[myIdx]++;
+    }
+    TxPacket(myIdx, _devices.SRN[myIdx], _devices.destination[myIdx], _devices.seq[myIdx], plant.Y[k]);
+    _devices.rxTrigger[myIdx] = false;
   }
-  TxPacket(myIdx, _devices[myIdx].SRN, _devices[myIdx].destination, _devices[myIdx].seq, Y);
-  _devices[myIdx].rxTrigger = false;
 
-  // std::cout << _devices[myIdx].X[0] << "\t" << _devices[myIdx].X[1] << "\t" << _devices[myIdx].X[2] << std::endl;
-  // std::cout << _devices[myIdx].X_t[0] << "\t" << _devices[myIdx].X_t[1] << "\t" << _devices[myIdx].X_t[2] << std::endl;
-  //std::cout << "Plant TX [" << Simulator::Now ().GetSeconds () << "]" << cycle << " times /// " << Y << " " << _devices[myIdx].U << std::endl;
-  Simulator::Schedule(Seconds(interval), &PlantTxCallback, cycle-1, interval, myIdx);
+  loopGroups[group].plantCycle = cycle - 1;
+  loopGroups[group].plantNextTs = (Simulator::Now () + Seconds (interval)).GetTimeStep ();
+  Simulator::Schedule(Seconds(interval), &PlantTxCallback, cycle-1, interval, group);
 }
 
-// static void StateChangeNotification (std::string context, Time now, LrWpanPhyEnumeration oldState, LrWpanPhyEnumeration newState)
-// {
-//   NS_LOG_UNCOND (context << " state change at " << now.GetSeconds ()
-//                          << " from " << LrWpanHelper::LrWpanPhyEnumerationPrinter (oldState)
-//                          << " to " << LrWpanHelper::LrWpanPhyEnumerationPrinter (newState));
-// }
+// Application state snapshot: what the controllers, plants and relays keep
+// between events (banks, sequence numbers, routes, duplicate tables, event
+// trigger state) and each group's pending controller/plant timer, in host
+// layout for the same binary. MAC/PHY state, frames in flight and RNG stream
+// positions are not in it, ns-3 does not expose them: a restored run starts
+// with idle radios and fresh streams. Forked variants keep all of it.
+const uint32_t SNAPSHOT_MAGIC = 0x57535331;  // "WSS1"
+
+template <class T>
+void WriteVector (std::ostream &out, const std::vector<T> &v) {
+  static_assert (std::is_trivially_copyable<T>::value, "raw snapshot of a non-trivial type");
+  uint64_t n = v.size ();
+  out.write (reinterpret_cast<const char*>(&n), sizeof (n));
+  out.write (reinterpret_cast<const char*>(v.data ()), n * sizeof (T));
+}
 
-int main (int argc, char *argv[])
-{
-  // PI controller
-  Kp = 0.060826;
-  Ki = 0.030286;
-  Kd = 0;
+// only into a vector of the same size, i.e. the same scenario
+template <class T>
+bool ReadVector (std::istream &in, std::vector<T> &v) {
+  uint64_t n = 0;
+  in.read (reinterpret_cast<char*>(&n), sizeof (n));
+  if (!in || n != v.size ()) {
+    return false;
+  }
+  in.read (reinterpret_cast<char*>(v.data ()), n * sizeof (T));
+  return static_cast<bool>(in);
+}
+
+bool WriteSnapshot (std::string path) {
+  std::ofstream out (path.c_str (), std::ios::binary | std::ios::trunc);
+  uint32_t header[4] = {SNAPSHOT_MAGIC, static_cast<uint32_t>(nodeSize),
+                        static_cast<uint32_t>(loopMetrics.size ()), static_cast<uint32_t>(loopGroups.size ())};
+  int64_t now = Simulator::Now ().GetTimeStep ();
+  out.write (reinterpret_cast<const char*>(header), sizeof (header));
+  out.write (reinterpret_cast<const char*>(&now), sizeof (now));
+
+  WriteVector (out, _devices.seq);
+  WriteVector (out, _devices.rxTrigger);
+  WriteVector (out, _devices.lastSent);
+  WriteVector (out, _devices.lastSentTs);
+  WriteVector (out, _devices.SRN);
+  for (size_t i = 0; i < _devices.DSN_Table.size (); i++) {
+    _devices.DSN_Table[i].Write (out);
+  }
+  for (size_t g = 0; g < loopGroups.size (); g++) {
+    LoopGroup &group = loopGroups[g];
+    WriteVector (out, group.controllers.Y);
+    WriteVector (out, group.controllers.U);
+    WriteVector (out, group.controllers.error_sum);
+    WriteVector (out, group.controllers.error_last);
+    for (int i = 0; i < PLANT_ORDER; i++) {
+      WriteVector (out, group.plants.X[i]);
+    }
+    WriteVector (out, group.plants.U);
+    WriteVector (out, group.plants.Y);
+    int64_t timers[4] = {group.controllerCycle, group.controllerNextTs, group.plantCycle, group.plantNextTs};
+    out.write (reinterpret_cast<const char*>(timers), sizeof (timers));
+  }
+  for (size_t l = 0; l < loopMetrics.size (); l++) {
+    out.write (reinterpret_cast<const char*>(&loopMetrics[l].lastSampleTs), sizeof (int64_t));
+  }
+  return static_cast<bool>(out);
+}
+
+// Load a snapshot into the freshly built scenario and schedule the group
+// timers where they were. Planned controller routes are kept from this run's
+// own planning, so a variant's routing options apply.
+void RestoreSnapshot (std::string path) {
+  std::ifstream in (path.c_str (), std::ios::binary);
+  uint32_t header[4] = {0, 0, 0, 0};
+  int64_t at = 0;
+  in.read (reinterpret_cast<char*>(header), sizeof (header));
+  in.read (reinterpret_cast<char*>(&at), sizeof (at));
+  NS_ABORT_MSG_IF (!in || header[0] != SNAPSHOT_MAGIC, path << " is not a snapshot");
+  NS_ABORT_MSG_IF (header[1] != static_cast<uint32_t>(nodeSize) || header[2] != loopMetrics.size () ||
+                   header[3] != loopGroups.size (), path << " is a snapshot of a different scenario");
+
+  std::vector<SourceRoute> planned = _devices.SRN;
+  bool ok = ReadVector (in, _devices.seq) && ReadVector (in, _devices.rxTrigger) &&
+            ReadVector (in, _devices.lastSent) && ReadVector (in, _devices.lastSentTs) &&
+            ReadVector (in, _devices.SRN);
+  for (size_t i = 0; ok && i < _devices.DSN_Table.size (); i++) {
+    ok = _devices.DSN_Table[i].Read (in);
+  }
+  for (size_t g = 0; ok && g < loopGroups.size (); g++) {
+    LoopGroup &group = loopGroups[g];
+    ok = ReadVector (in, group.controllers.Y) && ReadVector (in, group.controllers.U) &&
+         ReadVector (in, group.controllers.error_sum) && ReadVector (in, group.controllers.error_last);
+    for (int i = 0; ok && i < PLANT_ORDER; i++) {
+      ok = ReadVector (in, group.plants.X[i]);
+    }
+    ok = ok && ReadVector (in, group.plants.U) && ReadVector (in, group.plants.Y);
+    int64_t timers[4];
+    in.read (reinterpret_cast<char*>(timers), sizeof (timers));
+    group.controllerCycle = timers[0];
+    group.controllerNextTs = timers[1];
+    group.plantCycle = timers[2];
+    group.plantNextTs = timers[3];
+  }
+  for (size_t l = 0; ok && l < loopMetrics.size (); l++) {
+    in.read (reinterpret_cast<char*>(&loopMetrics[l].lastSampleTs), sizeof (int64_t));
+  }
+  NS_ABORT_MSG_IF (!ok || !in, path << " is truncated or from a different scenario");
+
+  if (plannedRoutes) {
+    for (size_t l = 0; l < loopMetrics.size (); l++) {
+      _devices.SRN[loopMetrics[l].controller] = planned[loopMetrics[l].controller];
+    }
+  }
+  for (size_t g = 0; g < loopGroups.size (); g++) {
+    const LoopGroup &group = loopGroups[g];
+    if (group.controllerCycle >= 0) {
+      Simulator::Schedule (TimeStep (group.controllerNextTs), &ControllerTxCallback,
+                           group.controllerCycle, group.interval, static_cast<int>(g));
+    }
+    if (group.plantCycle >= 0) {
+      Simulator::Schedule (TimeStep (group.plantNextTs), &PlantTxCallback,
+                           group.plantCycle, group.interval, static_cast<int>(g));
+    }
+  }
+  std::cout << "restored " << path << " at " << TimeStep (at).GetSeconds () << " s" << std::endl;
+}
+
+// all runs branching off a snapshot measure from there on
+void ResetLoopMetrics () {
+  for (size_t l = 0; l < loopMetrics.size (); l++) {
+    LoopMetrics fresh;
+    fresh.controller = loopMetrics[l].controller;
+    fresh.plant = loopMetrics[l].plant;
+    fresh.period = loopMetrics[l].period;
+    fresh.channel = loopMetrics[l].channel;
+    fresh.lastSampleTs = loopMetrics[l].lastSampleTs;
+    loopMetrics[l] = fresh;
+  }
+  if (useEnergy) {
+    energy.Restart ();
+  }
+}
+
+// In a forked child: take the variant's options (those that still matter
+// mid-run), re-plan if routing changed and write results under new names.
+// The channel plan is not redone (bridge radios are attached and traced for
+// good), which is why routing variants are refused with several channels.
+void ApplyVariant (int i, std::string spec) {
+  int oldPaths = routePaths, oldMaxHops = routeMaxHops;
+  double oldReliability = routeReliability, oldMinPrr = routeMinPrr, oldRange = routeRange;
+  std::vector<std::string> args (1, "variant");
+  std::istringstream ss (spec);
+  std::string arg;
+  while (ss >> arg) {
+    args.push_back ("--" + arg);
+  }
+  std::vector<char*> argv;
+  for (size_t k = 0; k < args.size (); k++) {
+    argv.push_back (const_cast<char*>(args[k].c_str ()));
+  }
+
+  CommandLine cmd;
+  cmd.AddValue ("routePaths", "Node-disjoint paths per loop at most", routePaths);
+  cmd.AddValue ("routeMaxHops", "Hop limit of a planned path", routeMaxHops);
+  cmd.AddValue ("routeReliability", "Stop adding paths once a loop's delivery probability reaches this", routeReliability);
+  cmd.AddValue ("routeMinPrr", "Links with a lower packet reception ratio are not used", routeMinPrr);
+  cmd.AddValue ("routeRange", "Links longer than this are not used (m, 0: no limit, which needs every pair's gain)", routeRange);
+  cmd.AddValue ("txPowerControl", "Lowest TX power per radio that reaches the next hops of the planned routes", txPowerControl);
+  cmd.AddValue ("txPowerMargin", "Margin of --txPowerControl over the receive power a hop needs (dB)", txPowerMargin);
+  cmd.AddValue ("trigger", "When endpoints send: periodic, absolute, relative or state", triggerMode);
+  cmd.AddValue ("triggerThreshold", "Change of the value (scaled for relative/state) that triggers a sample", triggerThreshold);
+  cmd.AddValue ("heartbeat", "Longest time an event-triggered endpoint stays silent (s)", heartbeat);
+  cmd.AddValue ("suppressCopies", "Cancel a delayed rebroadcast after this many copies from closer nodes (0: off)", suppressCopies);
+  cmd.AddValue ("suppressDelay", "Upper bound of the random rebroadcast delay (s)", suppressDelay);
+  cmd.AddValue ("dsnWindow", "Duplicate suppression window (s)", dsnWindow);
+  cmd.Parse (argv.size (), argv.data ());
+
+  SetTriggerMode ();
+  FrameCodec::Get ().CheckWindow (MinLoopPeriod (), dsnWindow);
+  NS_ABORT_MSG_IF (suppressCopies > 0 && !suppressJitter, "variant " << i << ": suppression must be on from the start");
+  bool rerouted = routePaths != oldPaths || routeMaxHops != oldMaxHops ||
+                  routeReliability != oldReliability || routeMinPrr != oldMinPrr || routeRange != oldRange;
+  if (plannedRoutes) {
+    if (rerouted) {
+      PlanRoutes (routeGains);
+      if (useTdma) {
+        BuildSuperframe ();
+      }
+    }
+    if (txPowerControl || !txPowers.empty ()) {  // also back to full power
+      AssignTxPower ();
+    }
+  }
+  SizeDsnTables ();
+  std::ostringstream suffix;
+  suffix << ".variant" << i;
+  if (!metricsFile.empty ()) {
+    metricsFile += suffix.str ();
+  }
+  if (!statsFile.empty ()) {
+    statsFile += suffix.str ();
+  }
+  if (!profileFile.empty ()) {
+    profileFile += suffix.str ();
+  }
+  std::cout << "variant " << i << " (" << spec << ") from " << Simulator::Now ().GetSeconds () << " s" << std::endl;
+}
+
+void TakeSnapshot () {
+  if (!snapshotFile.empty ()) {
+    NS_ABORT_MSG_IF (!WriteSnapshot (snapshotFile), "cannot write " << snapshotFile);
+    std::cout << "snapshot at " << Simulator::Now ().GetSeconds () << " s written to " << snapshotFile << std::endl;
+  }
+  ResetLoopMetrics ();
+
+  // the children share everything with this process copy-on-write; this one
+  // carries on unchanged as the baseline
+  std::istringstream ss (variants);
+  std::string spec;
+  int i = 0;
+  while (std::getline (ss, spec, ';')) {
+    i++;
+    std::cout.flush ();
+    pid_t pid = fork ();
+    if (pid == 0) {
+      variantPids.clear ();
+      ApplyVariant (i, spec);
+      return;
+    }
+    if (pid < 0) {
+      std::cerr << "fork for variant " << i << " failed" << std::endl;
+    } else {
+      variantPids.push_back (pid);
+    }
+  }
+}
+
+// Simulator throughput of the run just finished, for wsan-benchmark.
+void WriteRunStats (int64_t setupMs, int64_t runMs) {
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  double simS = Simulator::Now ().GetSeconds ();
+  uint64_t events = Simulator::GetEventCount ();
+  double runS = runMs / 1000.0;
+  int maxActive = 0;
+  double concurrency = Concurrency (maxActive);
+
+  std::ofstream out (statsFile.c_str ());
+  out << "{\"nodes\":" << nodeSize << ",\"loops\":" << loopCount
+      << ",\"max_hops\":" << routeMaxHops << ",\"period\":" << controlPeriod
+      << ",\"setup_s\":" << setupMs / 1000.0 << ",\"run_s\":" << runS
+      << ",\"sim_s\":" << simS << ",\"wall_per_sim_s\":" << (simS > 0 ? runS / simS : 0)
+      << ",\"events\":" << events << ",\"events_per_s\":" << (runS > 0 ? events / runS : 0)
+      << ",\"peak_rss_kb\":" << usage.ru_maxrss << ",\"realtime\":" << (useRealtime ? "true" : "false")
+      << ",\"overruns\":" << PacingOverruns () << ",\"max_lag_us\":" << PacingMaxLag () / 1000.0
+      << ",\"tx_power_control\":" << (txPowerControl ? "true" : "false") << ",\"concurrency\":" << concurrency
+      << ",\"max_concurrent\":" << maxActive << ",\"loop_latency_us\":" << MeanLoopLatency ()
+      << ",\"delivery_ratio\":" << DeliveryRatio () << "}" << std::endl;
+}
 
-  // DC Motor Position Control
-  _A[0] = 1; _A[1] = 0.0168850192401696;    _A[2] = 9.85229679853156e-05;
-  _A[3] = 0; _A[4] = 7.17313525970281e-06;  _A[5] = 4.18564730646073e-08;
-  _A[6] = 0; _A[7] = -4.91379773242829e-08; _A[8] = -2.86728515475999e-10;
+void SetRadioChannel (Ptr<LrWpanNetDevice> dev, int ch) {
+  if (ch != FIRST_CHANNEL) {  // LrWpanPhy starts on channel 11
+    LrWpanPhyPibAttributes attr;
+    attr.phyCurrentChannel = ch;
+    dev->GetPhy ()->PlmeSetAttributeRequest (phyCurrentChannel, &attr);
+  }
+  dev->GetPhy ()->TraceConnectWithoutContext ("PhyTxBegin", MakeBoundCallback (&ChannelTxBegin, ch));
+  channelStats[ch - FIRST_CHANNEL].radios++;
+  if (useEnergy) {
+    int radio = energy.AddRadio (GetNodeIndex (dev->GetMac ()->GetShortAddress ()));
+    dev->GetPhy ()->TraceConnectWithoutContext ("TrxState", MakeBoundCallback (&PhyStateChange, radio));
+  }
+}
+
+// Spread the loops round robin over channels 11.. and tune the radios: an
+// endpoint to its loop's channel, a relay to the channels of the loops whose
+// relay sets contain it (the first on its own radio, any further one on an
+// extra bridge radio of the same node). Needs the planned relay sets.
+void AssignChannels (Ptr<SpectrumChannel> channel) {
+  channelStats.assign (channelCount, ChannelStats ());
+  bridgeRadios.assign (nodeSize, std::vector<std::pair<int, Ptr<LrWpanNetDevice> > > ());
+  std::vector<std::vector<int> > wanted (nodeSize);
+  for (size_t l = 0; l < loopMetrics.size (); l++) {
+    LoopMetrics &m = loopMetrics[l];
+    m.channel = FIRST_CHANNEL + l % channelCount;
+    channelStats[m.channel - FIRST_CHANNEL].loops++;
+    wanted[m.controller].push_back (m.channel);
+    wanted[m.plant].push_back (m.channel);
+    const SourceRoute &relays = _devices.SRN[m.controller];
+    for (int i = 0; i < nodeSize; i++) {
+      if (_devices.node_role[i] == RELAY_NODE_ROLE && relays.Contains (i) &&
+          std::find (wanted[i].begin (), wanted[i].end (), m.channel) == wanted[i].end ()) {
+        wanted[i].push_back (m.channel);
+      }
+    }
+  }
+
+  int bridges = 0;
+  for (int i = 0; i < nodeSize; i++) {
+    SetRadioChannel (devices[i], wanted[i].empty () ? FIRST_CHANNEL : wanted[i][0]);
+    for (size_t k = 1; bridgeRelays && k < wanted[i].size (); k++) {
+      Ptr<LrWpanNetDevice> radio = CreateObject<LrWpanNetDevice> ();
+      radio->SetAddress (devices[i]->GetMac ()->GetShortAddress ());
+      radio->SetChannel (channel);
+      nodes[i]->AddDevice (radio);
+      radio->GetPhy ()->SetMobility (mobilities[i]);
+      radio->GetMac ()->SetMcpsDataIndicationCallback (aggregateWindow > 0 ? MakeCallback (&AggregateRxCallback)
+                                                                           : MakeCallback (&RelayDeviceRxCallback));
+      SetRadioChannel (radio, wanted[i][k]);
+      bridgeRadios[i].push_back (std::make_pair (wanted[i][k], radio));
+    }
+    bridges += wanted[i].size () > 1;
+  }
+  std::cout << "channels: " << loopMetrics.size () << " loops on " << channelCount << " channels, "
+            << bridges << " relays shared across channels" << (bridgeRelays ? " (bridged)" : " (not bridged)") << std::endl;
+}
 
-  _B[0] = 6.56042165678637;
-  _B[1] = 35.8265338128420;
-  _B[2] = 0.00458824345371420;
+// BuildingsHelper::MakeConsistent () for every node at once: the building
+// list is read once, and the info objects are already at hand.
+void MakeBuildingsConsistent () {
+  std::vector<Ptr<Building> > buildings (BuildingList::Begin (), BuildingList::End ());
+  for (int i = 0; i < nodeSize; i++) {
+    Vector pos = mobilities[i]->GetPosition ();
+    size_t b = 0;
+    while (b < buildings.size () && !buildings[b]->IsInside (pos)) {
+      b++;
+    }
+    if (b < buildings.size ()) {
+      buildingInfos[i]->SetIndoor (buildings[b], buildings[b]->GetFloor (pos),
+                                   buildings[b]->GetRoomX (pos), buildings[b]->GetRoomY (pos));
+    } else {
+      buildingInfos[i]->SetOutdoor ();
+    }
+  }
+}
 
-  _C[0] = 1; _C[1] = 0; _C[2] = 0;
+// Build the scenario, run it and tear it down.
+void RunScenario ()
+{
+  SystemWallClockMs setupClock;
+  setupClock.Start ();
+
+  const ScenarioHeader &plan = *scenario.header;
+  NS_ABORT_MSG_IF (nodeSize < static_cast<int>(plan.nodes) || nodeSize > MAX_NODE_SIZE,
+                   "--nodes must be in [" << plan.nodes << ", " << MAX_NODE_SIZE << "]");
+  if (useRealtime) {
+    NS_ABORT_MSG_IF (replications > 0 || !variants.empty (), "--realtime runs one scenario against the wall clock: no forked runs");
+    NS_ABORT_MSG_IF (!restoreFile.empty (), "--realtime would first wait out the time before the snapshot");
+    // before anything touches the simulator
+    GlobalValue::Bind ("SimulatorImplementationType", StringValue ("ns3::RealtimeSimulatorImpl"));
+  }
+#ifdef WSAN_PROFILE
+  ObjectFactory scheduler;
+  scheduler.SetTypeId (ProfilingScheduler::GetTypeId ());
+  Simulator::SetScheduler (scheduler);
+#endif
+  nodes.resize (nodeSize);
+  devices.resize (nodeSize);
+  mobilities.resize (nodeSize);
+  buildingInfos.resize (nodeSize);
+  _devices.Resize (nodeSize);
+
+  // give the node to role: the first --loops loops of the scenario, with
+  // their fixed routes if it has them
+  int planLoops = std::min<int> (loopCount, plan.loops);
+  NS_ABORT_MSG_IF (loopCount > planLoops && plan.loops == 0, "the scenario has no loop to copy for --loops");
+  NS_ABORT_MSG_IF (loopCount > planLoops && scenario.HasRoutes () && !plannedRoutes,
+                   "loops beyond the scenario's have no fixed route: use --plannedRoutes");
+  loopMetrics.reserve (loopCount);
+  for (int l = 0; l < planLoops; l++) {
+    const ScenarioLoop &sl = scenario.loops[l];
+    const ScenarioModel &sm = scenario.models[sl.model];
+    AddLoop (sl.controller, sl.plant, sl.period > 0 ? sl.period : controlPeriod, sl.reference,
+             sl.kp, sl.ki, sl.kd, sm.order, sm.A, sm.B, sm.C);
+    if (scenario.HasRoutes ()) {
+      _devices.SRN[sl.controller].SetHops (scenario.routeHops + sl.routeFirst, sl.routeCount);
+    }
+  }
 
-  // give the node to role
-  _devices[0].node_role = CONTROLLER_ROLE;
-  _devices[0].destination = 1;
-  _devices[1].node_role = PLANT_ROLE;
-  _devices[1].destination = 0;
+  // further loops copy the first one and pair up the remaining nodes in index order
+  // (never the relays of the fixed route, which every loop shares without planning)
+  bool fixedRoute = !plannedRoutes && !scenario.HasRoutes ();
+  std::vector<int> unused;
+  for (int i = 0; i < nodeSize; i++) {
+    if (_devices.node_role[i] == RELAY_NODE_ROLE &&
+        !(fixedRoute && std::count (FIXED_ROUTE, FIXED_ROUTE + FIXED_ROUTE_HOPS, i) > 0)) {
+      unused.push_back (i);
+    }
+  }
+  NS_ABORT_MSG_IF (loopCount < 1 || 2 * (loopCount - planLoops) > static_cast<int>(unused.size ()),
+                   "--loops must be in [1, " << planLoops + unused.size () / 2 << "] for " << nodeSize << " nodes");
+  for (int l = 0; l < loopCount - planLoops; l++) {
+    const ScenarioLoop &sl = scenario.loops[0];
+    const ScenarioModel &sm = scenario.models[sl.model];
+    AddLoop (unused[2 * l], unused[2 * l + 1], sl.period > 0 ? sl.period : controlPeriod, sl.reference,
+             sl.kp, sl.ki, sl.kd, sm.order, sm.A, sm.B, sm.C);
+  }
 
-  _devices[2].node_role = CONTROLLER_ROLE;
-  _devices[2].destination = 22;
-  _devices[22].node_role = PLANT_ROLE;
-  _devices[22].destination = 2;
+  // on-air layout after the route, now that the number of loops is known
+  FrameCodec::Encoding encoding = encodingName == "fixed" ? FrameCodec::FIXED16 :
+                                  encodingName == "half" ? FrameCodec::HALF16 : FrameCodec::FULL;
+  FrameCodec::Get ().Configure (encoding, loopSeqBits);
+  FrameCodec::Get ().CheckWindow (MinLoopPeriod (), dsnWindow);
+  std::cout << "encoding: " << encodingName << ", " << FrameCodec::Get ().GetSerializedSize ()
+            << " bytes after the route" << std::endl;
 
   // initiating pacekt params
   txParams.m_dstPanId = 0;
@@ -384,17 +3574,42 @@ int main (int argc, char *argv[])
 
   // Building(double xMin, double xMax, double yMin, double yMax, double zMin, double zMax)
   Ptr<Building> building1 = CreateObject<Building> ();
-  building1->SetBuildingType (Building::Residential);
-  building1->SetExtWallsType (Building::ConcreteWithWindows);
-  building1->SetBoundaries (Box (-20, 60, 0, 30, 0, 0));
-  // building1->SetNRoomsX (16);
-  // building1->SetNRoomsY (5);
-  building1->SetNRoomsX (40);
-  building1->SetNRoomsY (15);
+  building1->SetBuildingType (static_cast<Building::BuildingType_t>(plan.buildingType));
+  building1->SetExtWallsType (static_cast<Building::ExtWallsType_t>(plan.wallsType));
+  building1->SetBoundaries (Box (plan.building[0], plan.building[1], plan.building[2],
+                                 plan.building[3], plan.building[4], plan.building[5]));
+  building1->SetNRoomsX (plan.roomsX);
+  building1->SetNRoomsY (plan.roomsY);
+  building1->SetNFloors (plan.floors);
 
   // Create nodes, and a NetDevice for each one
   // Each device must be attached to the same channel
-  Ptr<SingleModelSpectrumChannel> channel = CreateObject<SingleModelSpectrumChannel> ();
+  NS_ABORT_MSG_IF (useGridChannel && !useLinkGainCache, "--gridChannel needs --linkGainCache");
+  NS_ABORT_MSG_IF (channelCount < 1 || channelCount > CHANNEL_COUNT_MAX, "--channels must be in [1, " << CHANNEL_COUNT_MAX << "]");
+  NS_ABORT_MSG_IF (channelCount > 1 && !plannedRoutes, "--channels needs --plannedRoutes");
+  NS_ABORT_MSG_IF (useTdma && !plannedRoutes, "--tdma needs --plannedRoutes");
+  NS_ABORT_MSG_IF (txPowerControl && !plannedRoutes, "--txPowerControl needs --plannedRoutes");
+  NS_ABORT_MSG_IF (loopSeqBits != 8 && loopSeqBits != 12, "--loopSeqBits must be 8 or 12");
+  NS_ABORT_MSG_IF (encodingName != "full" && encodingName != "fixed" && encodingName != "half",
+                   "--encoding must be full, fixed or half");
+  NS_ABORT_MSG_IF (!energy.SetProfile (energyProfile), "--energyProfile: comma-separated tx, rx, listen, busy or off=<mA>");
+  SetTriggerMode ();
+  NS_ABORT_MSG_IF (!variants.empty () && snapshotAt <= 0, "--variants needs --snapshotAt");
+  NS_ABORT_MSG_IF (!variants.empty () && !traceFile.empty (), "--variants can not fork the trace writer thread: no --traceFile");
+  NS_ABORT_MSG_IF (!variants.empty () && !cosimShm.empty (), "--variants can not fork the external plant process");
+  NS_ABORT_MSG_IF (variants.find ("route") != std::string::npos && channelCount > 1,
+                   "--variants can not re-plan routes over several --channels: relays would keep the old channel plan");
+  NS_ABORT_MSG_IF ((!snapshotFile.empty () || !restoreFile.empty ()) && !cosimShm.empty (),
+                   "the external plant's state is not part of snapshots: no --snapshotFile or --restoreFile with --cosim");
+  NS_ABORT_MSG_IF (!variants.empty () && replications > 0, "--variants and --replications both fork: use one");
+  Ptr<GridSpectrumChannel> gridChannel;
+  Ptr<SingleModelSpectrumChannel> channel;
+  if (useGridChannel) {
+    gridChannel = CreateObject<GridSpectrumChannel> ();
+    channel = gridChannel;
+  } else {
+    channel = CreateObject<SingleModelSpectrumChannel> ();
+  }
   Ptr<ConstantSpeedPropagationDelayModel> delayModel = CreateObject<ConstantSpeedPropagationDelayModel> ();
   // Ptr<RandomPropagationDelayModel> delayModel = CreateObject<RandomPropagationDelayModel> ();
   // Ptr<LogDistancePropagationLossModel> propModel = CreateObject<LogDistancePropagationLossModel> ();
@@ -407,52 +3622,40 @@ int main (int argc, char *argv[])
 
   // Ptr<FriisPropagationLossModel> propModel = CreateObject<FriisPropagationLossModel> ();
 
-  channel->AddPropagationLossModel (propModel);
+  Ptr<LinkGainCache> gainCache;
+  if (useLinkGainCache) {
+    gainCache = CreateObject<LinkGainCache> ();
+    gainCache->SetUnderlying (propModel);
+    channel->AddPropagationLossModel (gainCache);
+  } else {
+    channel->AddPropagationLossModel (propModel);
+  }
   channel->SetPropagationDelayModel (delayModel);
 
   // Ptr<RateErrorModel> em = CreateObject<RateErrorModel> ();
   // em->SetAttribute ("ErrorRate", DoubleValue (0.00001));
   // devices.Get (1)->SetAttribute ("ReceiveErrorModel", PointerValue (em));
 
-  double position[NODE_SIZE][3] = {
-    {27,2,0},
-    {44,27,0},
-    {26,5,0},
-    {19,8,0},
-    {23,8,0},
-    {29,8,0},
-    {37,8,0},
-    {48,8,0},
-    {10,10,0},
-    {20,11,0},
-    {25,11,0},
-    {30,11,0},
-    {26,18,0},
-    {31,18,0},
-    {14,19,0},
-    {22,20,0},
-    {29,20,0},
-    {37.5,19,0},
-    {48,19,0},
-    {31,22,0},
-    {42,22,0},
-    {34,25,0},
-    {38,26,0},
-  };
+  // nodes beyond the floor plan are extra relays spread over building1 (the
+  // variable only exists then: it would shift the streams of the devices)
+  Ptr<UniformRandomVariable> placement;
+  if (nodeSize > static_cast<int>(plan.nodes)) {
+    placement = CreateObject<UniformRandomVariable> ();
+  }
+  Box floor = building1->GetBoundaries ();
 
-  for (int i = 0; i < NODE_SIZE; i++) {
+  for (int i = 0; i < nodeSize; i++) {
     // init
     nodes[i] = CreateObject <Node> ();
     devices[i] = CreateObject<LrWpanNetDevice> ();
     mobilities[i] = CreateObject<ConstantPositionMobilityModel> ();
     buildingInfos[i] = CreateObject<MobilityBuildingInfo> ();
 
-    // assign MAC
-    std::ostringstream ss;
-    ss << std::setfill('0') << std::setw(4) << std::hex << i;
-    std::string result = ss.str().substr(0, 2) + ":" + ss.str().substr(2, 2);
-
-    devices[i]->SetAddress (Mac16Address (const_cast<char*>(result.c_str())));
+    // assign MAC: node index == 16-bit short address
+    uint8_t addr[2] = {static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i & 0xff)};
+    Mac16Address mac;
+    mac.CopyFrom (addr);
+    devices[i]->SetAddress (mac);
 
     // assign channel
     devices[i]->SetChannel (channel);
@@ -460,113 +3663,383 @@ int main (int argc, char *argv[])
     // To complete configuration, a LrWpanNetDevice must be added to a node
     nodes[i]->AddDevice (devices[i]);
 
-    // std::cout << devices[i]->GetMac ()->GetShortAddress() << std::endl;
-    // std::cout << devices[i]->GetAddress () << std::endl;
-    // std::cout << devices[i]->GetBroadcast () << std::endl;
-    // std::cout << Mac16Address (const_cast<char*>(result.c_str())) << std::endl;
-
     // configure position (m)
-    mobilities[i]->SetPosition (Vector (position[i][0], position[i][1], position[i][2]));  // x,y,z
+    if (i < static_cast<int>(plan.nodes)) {
+      const ScenarioNode &n = scenario.nodes[i];
+      mobilities[i]->SetPosition (Vector (n.x, n.y, n.z));  // x,y,z
+    } else {
+      mobilities[i]->SetPosition (Vector (placement->GetValue (floor.xMin, floor.xMax),
+                                          placement->GetValue (floor.yMin, floor.yMax), 0));
+    }
     mobilities[i]->AggregateObject (buildingInfos[i]);
-    BuildingsHelper::MakeConsistent (mobilities[i]);
     devices[i]->GetPhy ()->SetMobility (mobilities[i]);
 
-    // std::cout << mobilities[i]->GetPosition() << std::endl;
+    if (aggregateWindow > 0) {
+      devices[i]->GetMac ()->SetMcpsDataIndicationCallback (MakeCallback (&AggregateRxCallback));
 
-    if (_devices[i].node_role == CONTROLLER_ROLE) {
+    } else if (_devices.node_role[i] == CONTROLLER_ROLE) {
       devices[i]->GetMac ()->SetMcpsDataIndicationCallback (MakeCallback (&ControllerRxCallback));
-      _devices[i].reference = 10;
-      Simulator::Schedule(Seconds(0), &ControllerTxCallback, 100, 0.2, i);
-      // std::cout << "control " << i << std::endl;
 
-    } else if (_devices[i].node_role == PLANT_ROLE) {
+    } else if (_devices.node_role[i] == PLANT_ROLE) {
       devices[i]->GetMac ()->SetMcpsDataIndicationCallback (MakeCallback (&PlantRxCallback));
-      Simulator::Schedule(Seconds(0.1), &PlantTxCallback, 100, 0.2, i);
-      // std::cout << "plant " << i << std::endl;
 
     } else {
       devices[i]->GetMac ()->SetMcpsDataIndicationCallback (MakeCallback (&RelayDeviceRxCallback));
-      // std::cout << "relay " << i << std::endl;
     }
   }
 
+  MakeBuildingsConsistent ();
 
+  // controllers sample at the start of each period, plants half a period later
+  for (int g = 0; restoreFile.empty () && g < static_cast<int>(loopGroups.size ()); g++) {
+    double interval = loopGroups[g].interval;
+    Simulator::Schedule(Seconds(0), &ControllerTxCallback, controlCycles, interval, g);
+    Simulator::Schedule(Seconds(interval / 2), &PlantTxCallback, controlCycles, interval, g);
+    loopGroups[g].controllerCycle = loopGroups[g].plantCycle = controlCycles;
+    loopGroups[g].plantNextTs = Seconds (interval / 2).GetTimeStep ();
+  }
 
+  // all nodes are static: evaluate the building model once per link, the
+  // whole matrix up front only to keep it on disk
+  SystemWallClockMs gainClock;
+  gainClock.Start ();
+  if (useLinkGainCache && !linkGainCacheDir.empty ()) {
+    gainCache->Precompute (mobilities, LinkGainKey (mobilities, building1), linkGainCacheDir);
+  } else if (useLinkGainCache) {
+    gainCache->Index (mobilities);
+  }
+  if (plannedRoutes) {
+    Ptr<LinkGainCache> gains = gainCache;
+    if (!useLinkGainCache) {  // the planner still needs the gains once
+      gains = CreateObject<LinkGainCache> ();
+      gains->SetUnderlying (propModel);
+      gains->Index (mobilities);
+    }
+    PlanRoutes (gains);
+    routeGains = gains;
+  }
+  if (useLinkGainCache) {
+    std::cout << "link gains: " << gainCache->GetEvaluated () << " of " << static_cast<uint64_t>(nodeSize) * (nodeSize - 1)
+              << " pairs known after " << gainClock.End () << " ms" << std::endl;
+  }
 
+  // after routing: bridge radios depend on the relay sets
+  if (useEnergy) {
+    energy.Reset (nodeSize);
+  }
+  AssignChannels (channel);
+  if (txPowerControl) {
+    AssignTxPower ();
+  }
+  if (useTdma) {
+    BuildSuperframe ();
+  }
+  if (useGridChannel) {
+    gridChannel->BuildIndex (gainCache, delayModel, gridMaxTxPowerDbm, gridMinRxDbm, gridCellSize);
+  }
+  SizeDsnTables ();
 
+  // after routing, which a restored run keeps for its controllers
+  if (!restoreFile.empty ()) {
+    RestoreSnapshot (restoreFile);
+  }
+  if (snapshotAt > 0) {
+    Simulator::Schedule (Seconds (snapshotAt), &TakeSnapshot);
+  }
+  for (size_t g = 0; useRealtime && g < loopGroups.size (); g++) {  // after the controllers of t = 0
+    Simulator::Schedule (Seconds (0), &PacingProbe, controlCycles, loopGroups[g].interval);
+  }
 
+  if (!cosimShm.empty ()) {
+    // each loop's own period and model, as its group's plant bank holds them
+    static_assert (PLANT_ORDER <= static_cast<int>(COSIM_MAX_ORDER), "plant models must fit a CosimLoop");
+    std::vector<CosimLoop> models (loopMetrics.size (), CosimLoop ());
+    for (size_t l = 0; l < loopMetrics.size (); l++) {
+      int idx = loopMetrics[l].plant;
+      const PlantBank<PLANT_ORDER> &bank = loopGroups[_devices.group[idx]].plants;
+      int k = _devices.slot[idx];
+      CosimLoop &cl = models[l];
+      cl.period = loopMetrics[l].period;
+      cl.order = PLANT_ORDER;
+      for (int i = 0; i < PLANT_ORDER; i++) {
+        for (int j = 0; j < PLANT_ORDER; j++) {
+          cl.A[i * COSIM_MAX_ORDER + j] = bank.A[i * PLANT_ORDER + j][k];
+        }
+        cl.B[i] = bank.B[i][k];
+        cl.C[i] = bank.C[i][k];
+      }
+    }
+    NS_ABORT_MSG_IF (!cosim.Open (cosimShm, models, cosimPlant), "no plant process attached to " << cosimShm);
+    Simulator::ScheduleDestroy (&CloseCosim);
+  }
 
+  // created last so the streams of everything above stay as they were
+  if (suppressCopies > 0) {
+    suppressJitter = CreateObject<UniformRandomVariable> ();
+  }
 
+  if (!traceFile.empty ()) {
+    tracer.Open (traceFile);
+  }
 
+  Simulator::ScheduleDestroy (&DumpLoopMetrics);
+  Simulator::ScheduleDestroy (&CloseTrace);
 
+  int64_t setupMs = setupClock.End ();
+  std::cout << "setup took " << setupMs << " ms" << std::endl;
+  SystemWallClockMs runClock;
+  runClock.Start ();
 
+  pacingStart = std::chrono::steady_clock::now ();
+#ifdef WSAN_PROFILE
+  Profiler::Get ().Start (Seconds (profileInterval).GetTimeStep ());
+#endif
+  Simulator::Run ();
+#ifdef WSAN_PROFILE
+  Profiler::Get ().Report (profileFile);
+#endif
 
+  if (!statsFile.empty ()) {
+    WriteRunStats (setupMs, runClock.End ());
+  }
+  if (sendTrigger != TRIGGER_PERIODIC) {
+    uint64_t sent = 0, skipped = 0;
+    double errorSum = 0, errorSamples = 0;
+    for (size_t i = 0; i < loopMetrics.size (); i++) {
+      const LoopMetrics &m = loopMetrics[i];
+      sent += m.uplink.sent + m.downlink.sent;
+      skipped += m.uplink.skipped + m.downlink.skipped;
+      errorSum += m.abs_error_sum;
+      errorSamples += m.error_samples;
+    }
+    std::cout << "event-triggered (" << triggerMode << "): " << skipped << " of " << sent + skipped
+              << " samples not sent, mean |error| " << (errorSamples > 0 ? errorSum / errorSamples : 0) << std::endl;
+  }
+  if (aggregateWindow > 0) {
+    std::cout << "aggregation: " << aggregatedSamples << " samples in " << aggregatedFrames << " frames, "
+              << "queuing delay mean " << (aggregateDelaySamples ? aggregateDelaySum / 1e6 / aggregateDelaySamples : 0)
+              << " ms max " << aggregateDelayMax / 1e6 << " ms, " << aggregatedAirtime * 1000 << " ms airtime saved" << std::endl;
+  }
+  if (suppressCopies > 0) {
+    std::cout << "suppression: " << suppressedRelays << " rebroadcasts cancelled, " << suppressedAirtime * 1000
+              << " ms airtime saved, delivery ratio " << DeliveryRatio () << std::endl;
+  }
+  if (useEnergy) {
+    energy.Settle ();
+    int weakest = 0;
+    double relayMj = 0, maxRelayMj = 0;
+    int relays = 0, busiestRelay = -1;
+    for (int i = 0; i < nodeSize; i++) {
+      if (energy.LifetimeDays (i) < energy.LifetimeDays (weakest)) {
+        weakest = i;
+      }
+      if (_devices.node_role[i] == RELAY_NODE_ROLE && energy.nodes[i].relayed > 0) {
+        relays++;
+        relayMj += energy.EnergyMj (i);
+        if (energy.EnergyMj (i) > maxRelayMj) {
+          maxRelayMj = energy.EnergyMj (i);
+          busiestRelay = i;
+        }
+      }
+    }
+    std::cout << "energy: network lifetime " << energy.LifetimeDays (weakest) << " days (node " << weakest
+              << "), " << relays << " forwarding relays mean " << (relays ? relayMj / relays : 0) << " mJ max "
+              << maxRelayMj << " mJ (node " << busiestRelay << ")" << std::endl;
+  }
+  if (txPowerControl) {
+    int maxActive = 0;
+    double concurrency = Concurrency (maxActive);
+    std::cout << "tx power control: " << concurrency << " transmissions on the air while a channel is busy (max "
+              << maxActive << "), loop latency mean " << MeanLoopLatency () / 1000 << " ms, delivery ratio "
+              << DeliveryRatio () << std::endl;
+  }
+  if (useRealtime) {
+    std::vector<int64_t> lag (pacingLag);
+    std::sort (lag.begin (), lag.end ());
+    double mean = 0;
+    for (size_t i = 0; i < lag.size (); i++) {
+      mean += lag[i] / 1000.0 / lag.size ();
+    }
+    std::cout << "realtime: " << lag.size () << " periods, lag mean " << mean << " us p99 "
+              << (lag.empty () ? 0 : lag[lag.size () * 99 / 100] / 1000.0) << " us max " << PacingMaxLag () / 1000.0
+              << " us, " << PacingOverruns () << " overruns (> " << realtimeTolerance * 1000 << " ms)" << std::endl;
+  }
+  if (useGridChannel) {
+    std::cout << "grid channel: " << gridChannel->GetScheduled () << " of " << gridChannel->GetOffered ()
+              << " receptions scheduled" << std::endl;
+  }
+  uint64_t evictions = 0;
+  for (int i = 0; i < nodeSize; i++) {
+    evictions += _devices.DSN_Table[i].evictions;
+  }
+  if (evictions > 0) {
+    std::cerr << "warning: " << evictions << " DSNs dropped from full duplicate tables before --dsnWindow ended"
+              << std::endl;
+  }
 
+  Simulator::Destroy ();
 
-  // Trace state changes in the phy
-  // devices[0]->GetPhy ()->TraceConnect ("TrxState", std::string ("phy0"), MakeCallback (&StateChangeNotification));
-  // devices[1]->GetPhy ()->TraceConnect ("TrxState", std::string ("phy1"), MakeCallback (&StateChangeNotification));
-  // devices[15]->GetPhy ()->TraceConnect ("TrxState", std::string ("phy15"), MakeCallback (&StateChangeNotification));
-  // devices[16]->GetPhy ()->TraceConnect ("TrxState", std::string ("phy16"), MakeCallback (&StateChangeNotification));
-
-
-
-
-
-  // The below should trigger two callbacks when end-to-end data is working
-  // 1) DataConfirm callback is called
-  // 2) DataIndication callback is called with value of 50
-
-
-
-
-  // uint32_t SRN = TriggerNode(0);
-  // uint8_t direction = PLANT_DIRECTION;
-  // uint8_t seq = 255;
-  // double payload = -25.86;
-  //
-  // TxPacket(0, SRN, direction, seq, payload);
-
-  // Simulator::Schedule(Seconds(1), &TxPacket, 0, SRN, direction, seq, payload);
-  // seq++;
-  // Simulator::Schedule(Seconds(1.005), &TxPacket, 0, SRN, direction, seq, payload);
-  //
-  // Simulator::Schedule(Seconds(0), &SimInterval, 100, 0.2);
-
-
-
-
-  // all packets with the same destination can not be arrived at the destination simultaneously, where the device status is [RX_ON] or [RX_BUSY].
-
-  // seq = 0;
-  // pkt = {SRN, direction, seq, payload};
-  // serialized_pkt = static_cast<uint8_t*>(static_cast<void*>(&pkt));
-  // p0 = Create<Packet> (serialized_pkt, sizeof(pkt));
-  // devices[0]->GetMac ()->McpsDataRequest (txParams, p0);
-  // DSN_Queue[0].push_back(pkt.GetDsn());  // enqueue
-  // Simulator::Schedule(Seconds(Simulator::Now ().GetSeconds () + 1), &dequeue_handler, 0); // dequeue
+  for (size_t i = 0; i < variantPids.size (); i++) {
+    waitpid (variantPids[i], 0, 0);
+  }
+}
 
+// Driver mode: fork one child per replication (RngRun = base + i), at most
+// `jobs` at a time, collect each child's RunSummary through a pipe and stop
+// launching new runs once all confidence intervals are tight enough.
+int RunReplications ()
+{
+  int jobs = replicationJobs > 0 ? replicationJobs : std::max (1u, std::thread::hardware_concurrency ());
+  uint64_t baseRun = RngSeedManager::GetRun ();
+  std::string baseMetrics = metricsFile;
+  std::string baseTrace = traceFile;
+  std::string baseProfile = profileFile;
+
+  ReplicationStats stats[RunSummary::METRICS];
+  std::map<pid_t, int> running;  // child -> read end of its pipe
+  int launched = 0;
+  int failed = 0;
+  bool converged = false;
+
+  while (!running.empty () || (launched < replications && !converged)) {
+    while (static_cast<int>(running.size ()) < jobs && launched < replications && !converged) {
+      int fds[2];
+      NS_ABORT_MSG_IF (pipe (fds) != 0, "pipe () failed");
+      uint64_t run = baseRun + launched;
+      pid_t pid = fork ();
+      NS_ABORT_MSG_IF (pid < 0, "fork () failed");
+      if (pid == 0) {
+        close (fds[0]);
+        int devnull = open ("/dev/null", O_WRONLY);
+        dup2 (devnull, STDOUT_FILENO);  // per-run chatter stays out of the report
+        std::ostringstream suffix;
+        suffix << ".run" << run;
+        metricsFile = baseMetrics.empty () ? "" : baseMetrics + suffix.str ();
+        traceFile = baseTrace.empty () ? "" : baseTrace + suffix.str ();
+        profileFile = baseProfile.empty () ? "" : baseProfile + suffix.str ();
+        RngSeedManager::SetRun (run);
+        RunScenario ();
+        RunSummary r = SummarizeRun ();
+        ssize_t ok = write (fds[1], &r, sizeof (r));
+        _exit (ok == sizeof (r) ? 0 : 1);
+      }
+      close (fds[1]);
+      running[pid] = fds[0];
+      launched++;
+    }
 
-  // Simulator::ScheduleWithContext (1, Seconds (0.0),
-  //                                 &LrWpanMac::McpsDataRequest,
-  //                                 devices[0]->GetMac (), params, p0);
+    int status = 0;
+    pid_t pid = wait (&status);
+    if (pid < 0) {
+      break;
+    }
+    int fd = running[pid];
+    running.erase (pid);
+    RunSummary r;
+    ssize_t got = read (fd, &r, sizeof (r));
+    close (fd);
+    if (got != sizeof (r) || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+      failed++;
+      continue;
+    }
+    converged = true;
+    for (int i = 0; i < RunSummary::METRICS; i++) {
+      stats[i].Add (r.value[i]);
+      converged = converged && stats[i].Converged (replicationPrecision);
+    }
+    converged = converged && static_cast<int>(stats[0].n) >= minReplications;
+  }
 
-  // Send a packet back at time 2 seconds
-  // Ptr<Packet> p2 = Create<Packet> (60);  // 60 bytes of dummy data
-  // if (!extended)
-  //   {
-  //     params.m_dstAddr = Mac16Address ("00:01");
-  //   }
-  // else
-  //   {
-  //     params.m_dstExtAddr = Mac64Address ("00:00:00:00:00:00:00:01");
-  //   }
-  // Simulator::ScheduleWithContext (2, Seconds (2.0),
-  //                                 &LrWpanMac::McpsDataRequest,
-  //                                 devices[1]->GetMac (), params, p2);
+  std::cout << "replications: " << stats[0].n << " done, " << failed << " failed"
+            << (converged ? " (converged)" : "") << std::endl;
+  for (int i = 0; i < RunSummary::METRICS; i++) {
+    std::cout << RunSummary::Name (i) << ": " << stats[i].mean << " +/- " << stats[i].HalfWidth ()
+              << " (95% CI)" << std::endl;
+  }
+  return failed > 0 && stats[0].n == 0 ? 1 : 0;
+}
 
-  Simulator::Run ();
+int main (int argc, char *argv[])
+{
+  CommandLine cmd;
+  cmd.AddValue ("scenario", "Scenario compiled by wsan-scenario-compile; its values are the defaults of the options below (empty: built-in plan)", scenarioFile);
+  cmd.AddValue ("nodes", "Number of nodes (extra nodes beyond the floor plan are placed at random)", nodeSize);
+  cmd.AddValue ("dsnWindow", "Duplicate suppression window (s)", dsnWindow);
+  cmd.AddValue ("linkGainCache", "Evaluate each link gain of the static topology only once", useLinkGainCache);
+  cmd.AddValue ("metricsFile", "JSON file for per-loop latency/deadline metrics (empty: none)", metricsFile);
+  cmd.AddValue ("plannedRoutes", "Compute relay sets from the link gains (0: hand-picked path)", plannedRoutes);
+  cmd.AddValue ("routePaths", "Node-disjoint paths per loop at most", routePaths);
+  cmd.AddValue ("routeMaxHops", "Hop limit of a planned path", routeMaxHops);
+  cmd.AddValue ("routeReliability", "Stop adding paths once a loop's delivery probability reaches this", routeReliability);
+  cmd.AddValue ("routeMinPrr", "Links with a lower packet reception ratio are not used", routeMinPrr);
+  cmd.AddValue ("routeRange", "Links longer than this are not used (m, 0: no limit, which needs every pair's gain)", routeRange);
+  cmd.AddValue ("routeNoiseDbm", "Noise floor assumed by the planner (dBm)", routeNoiseDbm);
+  cmd.AddValue ("traceFile", "Binary event trace, decode with wsan-trace-decode (empty: off)", traceFile);
+  cmd.AddValue ("channels", "802.15.4 channels (from 11) the loops are spread over", channelCount);
+  cmd.AddValue ("bridgeRelays", "Give relays shared by loops on different channels a radio per channel", bridgeRelays);
+  cmd.AddValue ("tdma", "Transmit only in superframe slots generated from the planned routes", useTdma);
+  cmd.AddValue ("txPowerControl", "Lowest TX power per radio that reaches the next hops of the planned routes", txPowerControl);
+  cmd.AddValue ("txPowerMargin", "Margin of --txPowerControl over the receive power a hop needs (dB)", txPowerMargin);
+  cmd.AddValue ("txPowerMin", "Lowest TX power --txPowerControl assigns (dBm)", txPowerMinDbm);
+  cmd.AddValue ("slotLength", "TDMA slot length (s)", slotLength);
+  cmd.AddValue ("trigger", "When endpoints send: periodic, absolute, relative or state", triggerMode);
+  cmd.AddValue ("triggerThreshold", "Change of the value (scaled for relative/state) that triggers a sample", triggerThreshold);
+  cmd.AddValue ("heartbeat", "Longest time an event-triggered endpoint stays silent (s)", heartbeat);
+  cmd.AddValue ("encoding", "Payload on air: full (double), fixed (16-bit, payloadScale) or half", encodingName);
+  cmd.AddValue ("loopSeqBits", "Width of the combined loop/direction/sequence field of compact encodings (8 or 12)", loopSeqBits);
+  cmd.AddValue ("payloadScale", "Value of one LSB of the fixed-point payload", payloadScale);
+  cmd.AddValue ("aggregateWindow", "Relays merge samples forwarded within this window into one frame (s, 0: off)", aggregateWindow);
+  cmd.AddValue ("suppressCopies", "Cancel a delayed rebroadcast after this many copies from closer nodes (0: off)", suppressCopies);
+  cmd.AddValue ("suppressDelay", "Upper bound of the random rebroadcast delay (s)", suppressDelay);
+  cmd.AddValue ("cosim", "Step the plants in an external process over this POSIX shared memory name (empty: built in)", cosimShm);
+  cmd.AddValue ("cosimPlant", "Plant program to start for --cosim (e.g. wsan-cosim-plant; empty: attach to a running one)", cosimPlant);
+#ifdef WSAN_PROFILE
+  cmd.AddValue ("profileFile", "Profiler output prefix: <prefix>.folded (flamegraph.pl) and <prefix>.queue.csv (empty: summary only)", profileFile);
+  cmd.AddValue ("profileInterval", "Event queue sampling interval of the profiler (s)", profileInterval);
+#endif
+  cmd.AddValue ("energy", "Account radio time per PHY state, frames and energy per node", useEnergy);
+  cmd.AddValue ("energyProfile", "Current draw per PHY state, e.g. \"tx=17.4,rx=18.8,listen=18.8,busy=18.8,off=0.426\" (mA)", energyProfile);
+  cmd.AddValue ("supplyVoltage", "Supply voltage for the energy figures (V)", energy.voltage);
+  cmd.AddValue ("batteryMah", "Battery capacity for the lifetime figures (mAh)", energy.batteryMah);
+  cmd.AddValue ("realtime", "Pace the run against the wall clock and report the lag per control period", useRealtime);
+  cmd.AddValue ("realtimeTolerance", "Lag at a period start counted as an overrun (s)", realtimeTolerance);
+  cmd.AddValue ("snapshotAt", "Time to write --snapshotFile and fork --variants at (s, 0: never)", snapshotAt);
+  cmd.AddValue ("snapshotFile", "Application state snapshot written at snapshotAt (empty: none)", snapshotFile);
+  cmd.AddValue ("restoreFile", "Start from this snapshot instead of t = 0", restoreFile);
+  cmd.AddValue ("variants", "';'-separated option sets (e.g. \"routePaths=1;routePaths=3 routeMaxHops=6\"), each run in a child forked at snapshotAt", variants);
+  cmd.AddValue ("gridChannel", "Only schedule receptions above gridMinRxDbm, found through a spatial grid. Off by default:"
+                " weaker signals are dropped as interference too, so SINR near the noise floor comes out up to about 1 dB high",
+                useGridChannel);
+  cmd.AddValue ("gridMinRxDbm", "Weakest received power the grid channel still delivers, as signal or interference (dBm)", gridMinRxDbm);
+  cmd.AddValue ("gridCellSize", "Grid cell edge of the grid channel (m)", gridCellSize);
+  cmd.AddValue ("linkGainCacheDir", "Directory to load/save the full link gain matrix (empty: no file, gains evaluated on first use)", linkGainCacheDir);
+  cmd.AddValue ("loops", "Control loops (beyond the first two, pairs of unused nodes)", loopCount);
+  cmd.AddValue ("period", "Control period of every loop (s)", controlPeriod);
+  cmd.AddValue ("cycles", "Samples sent by each controller and plant", controlCycles);
+  cmd.AddValue ("statsFile", "JSON file for wall-clock/event/RSS statistics of the run (empty: none)", statsFile);
+  cmd.AddValue ("replications", "Run up to N independent replications in parallel (0: single run)", replications);
+  cmd.AddValue ("jobs", "Concurrent replications (0: one per core)", replicationJobs);
+  cmd.AddValue ("minReplications", "Replications before early stopping is considered", minReplications);
+  cmd.AddValue ("precision", "Stop once every 95% CI half-width is below this fraction of its mean", replicationPrecision);
+
+  // the scenario first, so that the options given next to it override it
+  for (int i = 1; i < argc; i++) {
+    if (std::strncmp (argv[i], "--scenario=", 11) == 0) {
+      scenarioFile = argv[i] + 11;
+    }
+  }
+  if (!scenarioFile.empty ()) {
+    NS_ABORT_MSG_IF (!scenario.Open (scenarioFile), scenarioFile << ": not a valid version " << SCENARIO_VERSION << " scenario");
+    nodeSize = scenario.header->nodes;
+    loopCount = scenario.header->loops;
+    controlPeriod = scenario.header->period;
+    plannedRoutes = !scenario.HasRoutes ();
+  }
+  cmd.Parse (argc, argv);
 
-  Simulator::Destroy ();
+  if (replications > 0) {
+    return RunReplications ();
+  }
+  RunScenario ();
   return 0;
 }
@@ -0,0 +1,187 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Simulator throughput benchmark for the scratch-simulator WSAN scenario.
+ *
+ * Runs scratch-simulator once per point of a grid of node counts, loop
+ * counts, route hop limits and control periods (each run in its own
+ * process, one after the other so runs do not disturb each other), and
+ * collects wall-clock time per simulated second, events per second and
+ * peak RSS into one JSON file:
+ *
+ *   ./waf --run "wsan-benchmark --nodes=23,100,400 --loops=2,8 --out=bench.json"
+ *
+ * With --realtime every point runs paced against the wall clock instead;
+ * the largest point without overruns is the largest network that can be
+ * emulated live on this machine.
+ *
+ * With --txPowerControl every point runs twice, at full power and with
+ * --txPowerControl, to see how concurrency and loop latency gain as loops
+ * are added:
+ *
+ *   ./waf --run "wsan-benchmark --nodes=400 --loops=2,4,8,16 --hops=8 --periods=0.2 --txPowerControl=1"
+ *
+ * The output schema is versioned ("wsan-bench/1"); fields are only ever
+ * added, so results of different commits can be compared directly.
+ */
+#include <ns3/core-module.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace ns3;
+
+std::vector<std::string> SplitList (std::string list) {
+  std::vector<std::string> items;
+  std::istringstream ss (list);
+  std::string item;
+  while (std::getline (ss, item, ',')) {
+    if (!item.empty ()) {
+      items.push_back (item);
+    }
+  }
+  return items;
+}
+
+// Run the simulator with args; returns its stats JSON object ("" on failure).
+std::string RunOnce (std::string simulator, std::vector<std::string> args, long &peakRssKb) {
+  std::string statsPath = "wsan-benchmark-stats.json";
+  unlink (statsPath.c_str ());
+  args.insert (args.begin (), simulator);
+  args.push_back ("--statsFile=" + statsPath);
+  args.push_back ("--metricsFile=");
+  args.push_back ("--traceFile=");
+
+  pid_t pid = fork ();
+  if (pid < 0) {
+    return "";
+  }
+  if (pid == 0) {
+    std::vector<char*> argv;
+    for (size_t i = 0; i < args.size (); i++) {
+      argv.push_back (const_cast<char*>(args[i].c_str ()));
+    }
+    argv.push_back (0);
+    int devnull = open ("/dev/null", O_WRONLY);
+    dup2 (devnull, STDOUT_FILENO);
+    execv (simulator.c_str (), argv.data ());
+    _exit (127);
+  }
+
+  int status = 0;
+  struct rusage usage;
+  if (wait4 (pid, &status, 0, &usage) != pid || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    return "";
+  }
+  peakRssKb = usage.ru_maxrss;
+
+  std::ifstream in (statsPath.c_str ());
+  std::string stats;
+  std::getline (in, stats);
+  unlink (statsPath.c_str ());
+  return stats;
+}
+
+int main (int argc, char *argv[])
+{
+  std::string self = argv[0];
+  std::string simulator = self.substr (0, self.find_last_of ('/') + 1) + "scratch-simulator";
+  std::string nodeList = "23,100,400";
+  std::string loopList = "2,8";
+  std::string hopList = "4,8";
+  std::string periodList = "0.2,0.05";
+  int cycles = 100;
+  bool realtime = false;
+  bool txPowerControl = false;
+  double txPowerMargin = 6;
+  std::string out = "wsan-benchmark.json";
+
+  CommandLine cmd;
+  cmd.AddValue ("simulator", "Path of the scratch-simulator binary", simulator);
+  cmd.AddValue ("nodes", "Comma-separated node counts", nodeList);
+  cmd.AddValue ("loops", "Comma-separated control loop counts", loopList);
+  cmd.AddValue ("hops", "Comma-separated route hop limits (routeMaxHops)", hopList);
+  cmd.AddValue ("periods", "Comma-separated control periods (s)", periodList);
+  cmd.AddValue ("cycles", "Samples per controller/plant in every run", cycles);
+  cmd.AddValue ("realtime", "Run every point against the wall clock; the stats then count pacing overruns", realtime);
+  cmd.AddValue ("txPowerControl", "Run every point also with --txPowerControl", txPowerControl);
+  cmd.AddValue ("txPowerMargin", "--txPowerMargin of those runs (dB)", txPowerMargin);
+  cmd.AddValue ("out", "JSON result file", out);
+  cmd.Parse (argc, argv);
+
+  std::vector<std::string> nodeCounts = SplitList (nodeList);
+  std::vector<std::string> loopCounts = SplitList (loopList);
+  std::vector<std::string> hopLimits = SplitList (hopList);
+  std::vector<std::string> periods = SplitList (periodList);
+
+  std::ofstream json (out.c_str ());
+  json << "{\"schema\":\"wsan-bench/1\",\"cycles\":" << cycles << ",\"results\":[";
+  bool first = true;
+  int failures = 0;
+
+  for (size_t a = 0; a < nodeCounts.size (); a++) {
+    for (size_t b = 0; b < loopCounts.size (); b++) {
+      for (size_t c = 0; c < hopLimits.size (); c++) {
+        for (size_t d = 0; d < periods.size (); d++) {
+          for (int e = 0; e < (txPowerControl ? 2 : 1); e++) {  // the stats tell the two apart
+            std::vector<std::string> args;
+            args.push_back ("--nodes=" + nodeCounts[a]);
+            args.push_back ("--loops=" + loopCounts[b]);
+            args.push_back ("--routeMaxHops=" + hopLimits[c]);
+            args.push_back ("--period=" + periods[d]);
+            std::ostringstream ss;
+            ss << "--cycles=" << cycles;
+            args.push_back (ss.str ());
+            if (realtime) {
+              args.push_back ("--realtime=1");
+            }
+            if (e == 1) {
+              std::ostringstream margin;
+              margin << "--txPowerMargin=" << txPowerMargin;
+              args.push_back ("--txPowerControl=1");
+              args.push_back (margin.str ());
+            }
+
+            long peakRssKb = 0;
+            std::string stats = RunOnce (simulator, args, peakRssKb);
+            std::cerr << "nodes=" << nodeCounts[a] << " loops=" << loopCounts[b] << " hops=" << hopLimits[c]
+                      << " period=" << periods[d] << (e == 1 ? " txPowerControl" : "") << ": "
+                      << (stats.empty () ? "FAILED" : stats) << std::endl;
+            if (stats.empty ()) {
+              failures++;
+              continue;
+            }
+            // the child's own stats, plus the peak RSS the kernel saw for it
+            json << (first ? "" : ",") << "\n{\"stats\":" << stats << ",\"peak_rss_kb\":" << peakRssKb << "}";
+            first = false;
+          }
+        }
+      }
+    }
+  }
+  json << "\n]}" << std::endl;
+  return failures > 0 ? 1 : 0;
+}
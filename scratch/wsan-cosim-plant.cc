@@ -0,0 +1,132 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Dummy external plant for the scratch-simulator co-simulation bridge
+ * (wsan-cosim.h). Every loop steps the discrete-time model the simulator
+ * put in the segment for it (the scenario's model, zero padded like the
+ * built-in plant bank), in the same summation order as PlantBank::Step ():
+ *
+ *   ./waf --run "scratch-simulator --cosim=/wsan-cosim --cosimPlant=build/scratch/wsan-cosim-plant"
+ *
+ * or start it by hand against a running simulator:
+ *
+ *   ./waf --run "wsan-cosim-plant --shm=/wsan-cosim"
+ */
+#include <ns3/core-module.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "wsan-cosim.h"
+
+using namespace ns3;
+
+const int ORDER = COSIM_MAX_ORDER;
+
+int main (int argc, char *argv[])
+{
+  std::string shm = "/wsan-cosim";
+
+  CommandLine cmd;
+  cmd.AddValue ("shm", "Shared memory object created by scratch-simulator --cosim", shm);
+  cmd.Parse (argc, argv);
+
+  int fd = shm_open (shm.c_str (), O_RDWR, 0);
+  if (fd < 0) {
+    std::cerr << "cannot open shared memory " << shm << std::endl;
+    return 1;
+  }
+  struct stat st;
+  if (fstat (fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof (CosimShared)) {
+    std::cerr << shm << ": too small for a co-simulation segment" << std::endl;
+    close (fd);
+    return 1;
+  }
+  void* map = mmap (0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "cannot map " << shm << std::endl;
+    return 1;
+  }
+  CosimShared* shared = static_cast<CosimShared*>(map);
+  if (shared->magic != COSIM_MAGIC || shared->version != COSIM_VERSION ||
+      static_cast<size_t>(st.st_size) < CosimSize (shared->loops)) {
+    std::cerr << shm << ": not a version " << COSIM_VERSION << " co-simulation segment" << std::endl;
+    munmap (map, st.st_size);
+    return 1;
+  }
+  const CosimLoop* models = CosimLoops (shared);
+  for (uint32_t l = 0; l < shared->loops; l++) {
+    if (models[l].order > COSIM_MAX_ORDER || models[l].period <= 0) {
+      std::cerr << shm << ": loop " << l << " has no usable model" << std::endl;
+      munmap (map, st.st_size);
+      return 1;
+    }
+  }
+
+  std::vector<double> x (shared->loops * ORDER, 0);
+  shared->attached.store (1, std::memory_order_release);
+
+  uint32_t spins = 0;
+  for (;;) {
+    CosimMessage m;
+    if (!shared->toPlant.Pop (m)) {
+      CosimBackoff (spins);
+      continue;
+    }
+    spins = 0;
+    if (m.kind == COSIM_SHUTDOWN) {
+      break;
+    }
+    if (m.kind != COSIM_STEP || m.loop >= shared->loops) {
+      continue;
+    }
+
+    // y = C x, then x = A x + B u, summed like PlantBank::Step (); the
+    // model is zero beyond its order
+    const CosimLoop &model = models[m.loop];
+    double* s = &x[m.loop * ORDER];
+    double y = 0;
+    for (int j = 0; j < ORDER; j++) {
+      y = (j == 0 ? 0 : y) + model.C[j] * s[j];
+    }
+    double next[ORDER];
+    for (int i = 0; i < ORDER; i++) {
+      for (int j = 0; j < ORDER; j++) {
+        next[i] = (j == 0 ? 0 : next[i]) + model.A[i * ORDER + j] * s[j];
+      }
+      next[i] += model.B[i] * m.value;
+    }
+    for (int i = 0; i < ORDER; i++) {
+      s[i] = next[i];
+    }
+
+    CosimMessage out = {m.time, m.loop, COSIM_OUTPUT, y};
+    while (!shared->toSim.Push (out)) {
+      CosimBackoff (spins);
+    }
+  }
+
+  munmap (map, st.st_size);
+  return 0;
+}
@@ -0,0 +1,128 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Shared-memory co-simulation interface between scratch-simulator and an
+ * external plant process (wsan-cosim-plant is a dummy one).
+ *
+ * The simulator creates a POSIX shared memory object holding one
+ * CosimShared: a header and two lock-free single-producer/single-consumer
+ * rings, followed by one CosimLoop per loop with its period and the
+ * discrete-time model the built-in plant bank would step. At every plant
+ * step it pushes COSIM_STEP messages (actuator commands) to toPlant and
+ * collects one COSIM_OUTPUT per loop (sensor output) from toSim, so
+ * simulation time advances in lockstep with the plant. Both sides
+ * busy-poll; a round trip costs a few cache-line transfers. COSIM_SHUTDOWN
+ * tells the plant process to exit.
+ */
+#ifndef WSAN_COSIM_H
+#define WSAN_COSIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+const uint32_t COSIM_MAGIC      = 0x57534353;  // "WSCS"
+const uint32_t COSIM_VERSION    = 2;
+const uint32_t COSIM_RING_SLOTS = 1024;        // power of two
+const uint32_t COSIM_MAX_ORDER  = 3;
+
+enum CosimKind {
+  COSIM_STEP     = 0,  // sim -> plant: apply value as actuator command, step once
+  COSIM_OUTPUT   = 1,  // plant -> sim: sensor output of that step
+  COSIM_SHUTDOWN = 2   // sim -> plant: no more steps
+};
+
+struct CosimMessage {
+  int64_t time;    // (ns) simulation time of the step
+  uint32_t loop;   // loop index (as in the metrics file)
+  uint32_t kind;   // CosimKind
+  double value;
+};
+
+// head is written only by the producer and tail only by the consumer, each
+// on its own cache line; a slot is published by the release store of head.
+struct CosimRing {
+  alignas (64) std::atomic<uint64_t> head;
+  alignas (64) std::atomic<uint64_t> tail;
+  alignas (64) CosimMessage slots[COSIM_RING_SLOTS];
+
+  bool Push (const CosimMessage &m) {
+    uint64_t h = head.load (std::memory_order_relaxed);
+    if (h - tail.load (std::memory_order_acquire) == COSIM_RING_SLOTS) {
+      return false;
+    }
+    slots[h & (COSIM_RING_SLOTS - 1)] = m;
+    head.store (h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool Pop (CosimMessage &m) {
+    uint64_t t = tail.load (std::memory_order_relaxed);
+    if (t == head.load (std::memory_order_acquire)) {
+      return false;
+    }
+    m = slots[t & (COSIM_RING_SLOTS - 1)];
+    tail.store (t + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// x' = A x + B u, y = C x, already discretized at period; lower orders
+// are zero padded up to COSIM_MAX_ORDER
+struct CosimLoop {
+  double period;  // (s) control period of the loop
+  uint32_t order;
+  uint32_t reserved;
+  double A[COSIM_MAX_ORDER * COSIM_MAX_ORDER];  // row-major
+  double B[COSIM_MAX_ORDER];
+  double C[COSIM_MAX_ORDER];
+};
+
+struct CosimShared {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t loops;
+  uint32_t reserved;
+  std::atomic<uint32_t> attached;  // set by the plant process once it polls
+  CosimRing toPlant;
+  CosimRing toSim;
+};
+
+// size of the segment: the header, then loops CosimLoop entries
+inline size_t CosimSize (uint32_t loops) {
+  return sizeof (CosimShared) + loops * sizeof (CosimLoop);
+}
+
+inline CosimLoop* CosimLoops (CosimShared* shared) {
+  return reinterpret_cast<CosimLoop*>(shared + 1);
+}
+
+// Busy-poll for the other process, yielding the core after a short spin so
+// that a single-core machine still hands over within a time slice.
+inline void CosimBackoff (uint32_t &spins) {
+  if (++spins > 64) {
+    std::this_thread::yield ();
+  }
+}
+
+// the rings live in memory shared between processes (C++11: the macro, not
+// is_always_lock_free)
+static_assert (ATOMIC_LLONG_LOCK_FREE == 2 && sizeof (uint64_t) == sizeof (long long),
+               "shared-memory ring needs lock-free 64-bit atomics");
+
+#endif /* WSAN_COSIM_H */
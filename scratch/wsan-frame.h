@@ -0,0 +1,422 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Frame handling of scratch-simulator that needs no simulation run: the
+ * duplicate (DSN) table, the source route and the compact encodings of the
+ * frame fields. Kept apart so wsan-unit-test checks them directly.
+ */
+#ifndef WSAN_FRAME_H
+#define WSAN_FRAME_H
+
+#include <ns3/abort.h>
+#include <ns3/buffer.h>
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+// Duplicate suppression: remembers the DSNs seen within the last window.
+// A fixed-capacity table indexed by DSN: each DSN hashes to one set of WAYS
+// slots holding a DSN and its expiry time, so a lookup reads at most WAYS
+// slots. A slot whose expiry has passed is free, so entries expire lazily
+// when the table is looked up (no dequeue events). The capacity is set from
+// the window and the node's load (Reserve ()); should a set still overflow,
+// the entry expiring first is dropped and counted in evictions.
+class DsnTable {
+public:
+  static const int WAYS = 8;
+  static const int MIN_SETS = 4;  // power of 2
+
+  bool Contains (uint32_t dsn, int64_t now) const {
+    if (slots.empty ()) {
+      return false;
+    }
+    const Slot* set = &slots[SetOf (dsn)];
+    for (int w = 0; w < WAYS; w++) {
+      if (set[w].expiry > now && set[w].dsn == dsn) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Insert (uint32_t dsn, int64_t now, int64_t window) {
+    if (slots.empty ()) {
+      Reserve (0, now);
+    }
+    Slot* set = &slots[SetOf (dsn)];
+    int victim = 0;
+    for (int w = 0; w < WAYS; w++) {
+      if (set[w].expiry <= now || set[w].dsn == dsn) {  // free, or the same DSN again
+        victim = w;
+        break;
+      }
+      if (set[w].expiry < set[victim].expiry) {
+        victim = w;
+      }
+      if (w == WAYS - 1) {
+        evictions++;
+      }
+    }
+    set[victim].dsn = dsn;
+    set[victim].expiry = now + window;
+  }
+
+  // room for this many live entries at once, at quarter load so that a set
+  // overflows next to never; live entries are kept when the capacity changes
+  void Reserve (int entries, int64_t now) {
+    int sets = MIN_SETS;
+    while (sets * WAYS < 4 * entries) {
+      sets *= 2;
+    }
+    if (sets * WAYS == static_cast<int>(slots.size ())) {
+      return;
+    }
+    std::vector<Slot> old;
+    old.swap (slots);
+    slots.assign (sets * WAYS, Slot ());
+    setBits = 0;
+    while ((1 << setBits) < sets) {
+      setBits++;
+    }
+    for (size_t i = 0; i < old.size (); i++) {
+      if (old[i].expiry > now) {
+        Insert (old[i].dsn, now, old[i].expiry - now);
+      }
+    }
+  }
+
+  int Size (int64_t now) const {
+    int live = 0;
+    for (size_t i = 0; i < slots.size (); i++) {
+      live += slots[i].expiry > now;
+    }
+    return live;
+  }
+
+  int Capacity () const {
+    return slots.size ();
+  }
+
+  // for snapshots
+  void Write (std::ostream &out) const {
+    uint32_t n = slots.size ();
+    out.write (reinterpret_cast<const char*>(&n), sizeof (n));
+    out.write (reinterpret_cast<const char*>(&setBits), sizeof (setBits));
+    out.write (reinterpret_cast<const char*>(slots.data ()), n * sizeof (Slot));
+  }
+
+  bool Read (std::istream &in) {
+    uint32_t n = 0;
+    in.read (reinterpret_cast<char*>(&n), sizeof (n));
+    in.read (reinterpret_cast<char*>(&setBits), sizeof (setBits));
+    if (!in || setBits < 0 || setBits > 24 || n != (n > 0 ? (1u << setBits) * WAYS : 0u)) {
+      return false;
+    }
+    slots.assign (n, Slot ());
+    in.read (reinterpret_cast<char*>(slots.data ()), n * sizeof (Slot));
+    return static_cast<bool>(in);
+  }
+
+  uint64_t evictions = 0;  // live entries dropped from a full set
+
+private:
+  struct Slot {
+    uint32_t dsn = 0;
+    int64_t expiry = 0;  // free once passed
+  };
+
+  // first slot of the DSN's set (Fibonacci hashing, so consecutive
+  // sequence numbers of a loop spread over the sets)
+  size_t SetOf (uint32_t dsn) const {
+    return static_cast<size_t>((dsn * 2654435769u) >> (32 - setBits)) * WAYS;
+  }
+
+  std::vector<Slot> slots;  // sets of WAYS slots, allocated by Reserve ()
+  int32_t setBits = 0;
+};
+
+// Source route: the set of nodes allowed to forward (or accept) a packet.
+// Encoded either as a bitmap over node indices or as an explicit hop list,
+// whichever is shorter, so small networks keep a few bytes on air while the
+// full 16-bit address space stays reachable. Storage is inline (no heap).
+class SourceRoute {
+public:
+  static const int MAX_BYTES = 64;       // bitmap: idx < 512, list: 32 hops
+  static const uint8_t HOP_LIST = 0x80;  // format flag in the length byte
+
+  void SetHops (const uint16_t* hops, int count) {
+    uint32_t maxIdx = 0;
+    for (int i = 0; i < count; i++) {
+      maxIdx = std::max<uint32_t> (maxIdx, hops[i]);
+    }
+    uint32_t bitmapBytes = count > 0 ? maxIdx / 8 + 1 : 0;
+    uint32_t listBytes = 2 * count;
+    std::memset (bytes, 0, sizeof (bytes));
+    if (bitmapBytes <= listBytes && bitmapBytes <= MAX_BYTES) {
+      format = 0;
+      len = bitmapBytes;
+      for (int i = 0; i < count; i++) {
+        bytes[hops[i] >> 3] |= 1 << (hops[i] & 7);
+      }
+    } else {
+      NS_ABORT_MSG_IF (listBytes > MAX_BYTES, "source route too long: " << count << " hops");
+      format = HOP_LIST;
+      len = listBytes;
+      for (int i = 0; i < count; i++) {
+        bytes[2 * i] = hops[i] >> 8;
+        bytes[2 * i + 1] = hops[i] & 0xff;
+      }
+    }
+  }
+
+  // am I a relay (or endpoint) of this route?
+  bool Contains (uint16_t idx) const {
+    if (format == 0) {
+      return (idx >> 3) < len && (bytes[idx >> 3] & (1 << (idx & 7)));
+    }
+    for (int i = 0; i < len; i += 2) {
+      if (((bytes[i] << 8) | bytes[i + 1]) == idx) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Empty () const {
+    return len == 0;
+  }
+
+  // the node indices of the route, in index order for a bitmap
+  void AppendHops (std::vector<uint16_t> &hops) const {
+    for (int i = 0; i < len; i++) {
+      if (format == 0) {
+        for (int b = 0; b < 8; b++) {
+          if (bytes[i] & (1 << b)) {
+            hops.push_back (8 * i + b);
+          }
+        }
+      } else if (i % 2 == 0) {
+        hops.push_back ((bytes[i] << 8) | bytes[i + 1]);
+      }
+    }
+  }
+
+  uint32_t GetSerializedSize () const {
+    return 1 + len;
+  }
+
+  void Serialize (ns3::Buffer::Iterator &start) const {
+    start.WriteU8 (format | len);
+    start.Write (bytes, len);
+  }
+
+  void Deserialize (ns3::Buffer::Iterator &start) {
+    uint8_t head = start.ReadU8 ();
+    format = head & HOP_LIST;
+    len = std::min<uint8_t> (head & ~HOP_LIST, MAX_BYTES);
+    start.Read (bytes, len);
+  }
+
+  void Print (std::ostream &os) const {
+    os << (format == 0 ? "bitmap[" : "hops[") << static_cast<int>(len) << "]";
+  }
+
+private:
+  uint8_t format = 0;
+  uint8_t len    = 0;
+  uint8_t bytes[MAX_BYTES];
+};
+
+// On-air encoding of the PacketStructure fields after the source route.
+// FULL is the original layout: 16-bit destination, 8-bit sequence and the
+// payload as an IEEE double (11 bytes). The compact encodings fold
+// destination and sequence into one 8- or 12-bit field (loop, direction,
+// sequence) and send the payload in 16 bits, either as fixed point with a
+// per-loop scale or as IEEE half precision (3 or 4 bytes after the route).
+class FrameCodec {
+public:
+  enum Encoding { FULL, FIXED16, HALF16 };
+
+  static FrameCodec &Get () {
+    static FrameCodec codec;
+    return codec;
+  }
+
+  int AddLoop (uint16_t ctrlIdx, uint16_t plantIdx, double scale) {
+    ends[ctrlIdx] = controller.size () << 1;
+    ends[plantIdx] = (controller.size () << 1) | 1;
+    controller.push_back (ctrlIdx);
+    plant.push_back (plantIdx);
+    scales.push_back (scale);
+    return controller.size () - 1;
+  }
+
+  // after the loops are added; the sequence gets what the loop index leaves
+  void Configure (Encoding _encoding, int _fieldBits) {
+    encoding = _encoding;
+    fieldBits = _fieldBits;
+    loopBits = 0;
+    while ((1u << loopBits) < controller.size ()) {
+      loopBits++;
+    }
+    seqBits = encoding == FULL ? 8 : fieldBits - loopBits - 1;
+    NS_ABORT_MSG_IF (seqBits < 3, controller.size () << " loops leave " << seqBits
+                     << " sequence bits in a " << fieldBits << "-bit field (need 3)");
+  }
+
+  // A loop's sequence number must not wrap while its last use is still in
+  // the duplicate tables, or fresh samples are dropped as duplicates.
+  void CheckWindow (double minPeriod, double window) const {
+    int bits = std::min (seqBits, 8);  // seq is a byte in every encoding
+    double wrap = (1u << bits) * minPeriod;
+    NS_ABORT_MSG_IF (wrap <= window,
+                     bits << " sequence bits wrap after " << wrap << " s at a " << minPeriod
+                     << " s period, within the " << window << " s --dsnWindow: shorten it, or use fewer loops or a wider --loopSeqBits");
+  }
+
+  Encoding GetEncoding () const {
+    return encoding;
+  }
+
+  uint8_t SeqMask () const {
+    return seqBits >= 8 ? 0xff : (1 << seqBits) - 1;
+  }
+
+  uint32_t GetSerializedSize () const {
+    return encoding == FULL ? 2 + 1 + 8 : (fieldBits + 7) / 8 + 2;
+  }
+
+  void Write (ns3::Buffer::Iterator &start, uint16_t dest_idx, uint8_t seq, double payload) const {
+    if (encoding == FULL) {
+      uint64_t bits;
+      std::memcpy (&bits, &payload, sizeof (bits));
+      start.WriteHtonU16 (dest_idx);
+      start.WriteU8 (seq);
+      start.WriteHtonU64 (bits);
+      return;
+    }
+    std::unordered_map<uint16_t, uint32_t>::const_iterator it = ends.find (dest_idx);
+    NS_ABORT_MSG_IF (it == ends.end (), "node " << dest_idx << " is not a loop endpoint");
+    uint32_t loop = it->second >> 1;
+    uint32_t field = (loop << (seqBits + 1)) | ((it->second & 1) << seqBits) | (seq & SeqMask ());
+    if (fieldBits <= 8) {
+      start.WriteU8 (field);
+    } else {
+      start.WriteHtonU16 (field);
+    }
+    bool saturated;
+    start.WriteHtonU16 (Encode (loop, payload, saturated));
+  }
+
+  void Read (ns3::Buffer::Iterator &start, uint16_t &dest_idx, uint8_t &seq, double &payload) const {
+    if (encoding == FULL) {
+      dest_idx = start.ReadNtohU16 ();
+      seq = start.ReadU8 ();
+      uint64_t bits = start.ReadNtohU64 ();
+      std::memcpy (&payload, &bits, sizeof (payload));
+      return;
+    }
+    uint32_t field = fieldBits <= 8 ? start.ReadU8 () : start.ReadNtohU16 ();
+    uint32_t loop = std::min<uint32_t> (field >> (seqBits + 1), controller.size () - 1);
+    dest_idx = (field >> seqBits) & 1 ? plant[loop] : controller[loop];
+    seq = field & SeqMask ();
+    payload = Decode (loop, start.ReadNtohU16 ());
+  }
+
+  // the payload as the destination will decode it
+  double Quantize (uint16_t dest_idx, double payload, bool &saturated) const {
+    saturated = false;
+    std::unordered_map<uint16_t, uint32_t>::const_iterator it = ends.find (dest_idx);
+    if (encoding == FULL || it == ends.end ()) {
+      return payload;
+    }
+    return Decode (it->second >> 1, Encode (it->second >> 1, payload, saturated));
+  }
+
+private:
+  uint16_t Encode (uint32_t loop, double v, bool &saturated) const {
+    if (encoding == FIXED16) {
+      double q = std::floor (v / scales[loop] + 0.5);
+      saturated = q < -32768 || q > 32767;
+      return static_cast<uint16_t>(static_cast<int16_t>(std::max (-32768.0, std::min (32767.0, q))));
+    }
+    saturated = std::fabs (v) > 65504;
+    return ToHalf (v);
+  }
+
+  double Decode (uint32_t loop, uint16_t bits) const {
+    if (encoding == FIXED16) {
+      return static_cast<int16_t>(bits) * scales[loop];
+    }
+    return FromHalf (bits);
+  }
+
+  // round to nearest even; out of range saturates at +-65504
+  static uint16_t ToHalf (double v) {
+    float f = static_cast<float>(v);
+    uint32_t x;
+    std::memcpy (&x, &f, sizeof (x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    int32_t exp = static_cast<int32_t>((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if (exp >= 31) {
+      return sign | 0x7bff;
+    }
+    if (exp <= 0) {  // subnormal
+      if (exp < -10) {
+        return sign;
+      }
+      mant |= 0x800000;
+      uint32_t shift = 14 - exp;
+      uint32_t half = mant >> shift;
+      uint32_t rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+      if (rem > mid || (rem == mid && (half & 1))) {
+        half++;
+      }
+      return sign | half;
+    }
+    uint32_t half = (exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) {
+      half++;
+    }
+    return sign | std::min<uint32_t> (half, 0x7bff);
+  }
+
+  static double FromHalf (uint16_t h) {
+    int exp = (h >> 10) & 0x1f;
+    int mant = h & 0x3ff;
+    double v = exp == 0 ? std::ldexp (mant, -24) : std::ldexp (mant | 0x400, exp - 25);
+    return (h & 0x8000) ? -v : v;
+  }
+
+  Encoding encoding = FULL;
+  int fieldBits = 8;
+  int loopBits = 0;
+  int seqBits = 8;
+  std::vector<uint16_t> controller;  // by loop
+  std::vector<uint16_t> plant;
+  std::vector<double> scales;        // fixed point: value of one LSB
+  std::unordered_map<uint16_t, uint32_t> ends;  // endpoint -> loop << 1 | is plant
+};
+
+#endif /* WSAN_FRAME_H */
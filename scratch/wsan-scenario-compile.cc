@@ -0,0 +1,263 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Compile a scenario source to the binary format scratch-simulator maps at
+ * startup (wsan-scenario.h):
+ *
+ *   ./waf --run "wsan-scenario-compile --in=scratch/wsan-floor.scn --out=floor.bin"
+ *   ./waf --run "scratch-simulator --scenario=floor.bin"
+ *
+ * One directive per line ('\' at the end continues it), '#' starts a comment:
+ *
+ *   building xMin xMax yMin yMax zMin zMax roomsX roomsY [floors [type [walls]]]
+ *            type: residential, office or commercial
+ *            walls: wood, concrete-windows, concrete or stone
+ *   period   seconds                    control period of loops without one
+ *   model    name order A... B... C...  A row-major, order <= 3
+ *   node     x y z                      node index = order of appearance
+ *   loop     controller plant model reference kp ki kd [period]
+ *   route    controller relay...        fixed relay path of that loop
+ *
+ * Routes are optional, but given for either every loop or none; a file
+ * with routes turns --plannedRoutes off by default.
+ */
+#include <ns3/core-module.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "wsan-scenario.h"
+
+using namespace ns3;
+
+// in the order of ns-3's Building::BuildingType_t and Building::ExtWallsType_t
+const char* BUILDING_TYPES[SCENARIO_BUILDING_TYPES] = {"residential", "office", "commercial"};
+const char* WALL_TYPES[SCENARIO_WALL_TYPES] = {"wood", "concrete-windows", "concrete", "stone"};
+
+int Lookup (const char* const* names, int count, std::string name) {
+  for (int i = 0; i < count; i++) {
+    if (name == names[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main (int argc, char *argv[])
+{
+  std::string in = "scenario.scn";
+  std::string out = "scenario.bin";
+
+  CommandLine cmd;
+  cmd.AddValue ("in", "Scenario source", in);
+  cmd.AddValue ("out", "Binary scenario for scratch-simulator --scenario", out);
+  cmd.Parse (argc, argv);
+
+  std::ifstream src (in.c_str ());
+  if (!src) {
+    std::cerr << "cannot open " << in << std::endl;
+    return 1;
+  }
+
+  // the built-in floor unless the source has its own
+  ScenarioHeader header = ScenarioHeader ();
+  header.magic = SCENARIO_MAGIC;
+  header.version = SCENARIO_VERSION;
+  header.roomsX = 40;
+  header.roomsY = 15;
+  header.floors = 1;
+  header.buildingType = 0;
+  header.wallsType = 1;
+  double building[6] = {-20, 60, 0, 30, 0, 0};
+  for (int i = 0; i < 6; i++) {
+    header.building[i] = building[i];
+  }
+  header.period = 0.2;
+
+  std::vector<ScenarioNode> nodes;
+  std::vector<ScenarioModel> models;
+  std::vector<ScenarioLoop> loops;
+  std::vector<uint16_t> routeHops;
+  std::map<std::string, uint32_t> modelIndex;
+  std::map<uint32_t, std::vector<uint16_t> > routes;  // controller -> relays
+  std::vector<int> roleOf;                            // node -> loop + 1, 0: relay
+
+  std::string line;
+  int lineNo = 0;
+  std::string error;
+  while (error.empty () && std::getline (src, line)) {
+    lineNo++;
+    line = line.substr (0, line.find ('#'));
+    std::string more;
+    while (!line.empty () && line[line.size () - 1] == '\\' && std::getline (src, more)) {
+      lineNo++;
+      line[line.size () - 1] = ' ';
+      line += more.substr (0, more.find ('#'));
+    }
+    std::istringstream ss (line);
+    std::string directive;
+    if (!(ss >> directive)) {
+      continue;
+    }
+
+    if (directive == "building") {
+      std::string type = "residential", walls = "concrete-windows";
+      for (int i = 0; i < 6; i++) {
+        ss >> header.building[i];
+      }
+      ss >> header.roomsX >> header.roomsY;
+      if (ss && !(ss >> header.floors)) {
+        header.floors = 1;
+      }
+      ss.clear ();
+      ss >> type >> walls;
+      int t = Lookup (BUILDING_TYPES, SCENARIO_BUILDING_TYPES, type);
+      int w = Lookup (WALL_TYPES, SCENARIO_WALL_TYPES, walls);
+      if (header.roomsX == 0 || header.roomsY == 0 || header.floors == 0 || t < 0 || w < 0 ||
+          header.building[0] >= header.building[1] || header.building[2] >= header.building[3]) {
+        error = "bad building";
+      }
+      header.buildingType = t;
+      header.wallsType = w;
+
+    } else if (directive == "period") {
+      if (!(ss >> header.period) || header.period <= 0) {
+        error = "bad period";
+      }
+
+    } else if (directive == "model") {
+      std::string name;
+      ScenarioModel m = ScenarioModel ();
+      ss >> name >> m.order;
+      if (!ss || m.order < 1 || m.order > SCENARIO_MAX_ORDER) {
+        error = "model needs a name and an order of 1 to 3";
+        break;
+      }
+      for (uint32_t i = 0; i < m.order * m.order; i++) {
+        ss >> m.A[i];
+      }
+      for (uint32_t i = 0; i < m.order; i++) {
+        ss >> m.B[i];
+      }
+      for (uint32_t i = 0; i < m.order; i++) {
+        ss >> m.C[i];
+      }
+      if (!ss || modelIndex.count (name)) {
+        error = "model " + name + ": wrong number of coefficients or defined twice";
+      }
+      modelIndex[name] = models.size ();
+      models.push_back (m);
+
+    } else if (directive == "node") {
+      ScenarioNode n;
+      if (!(ss >> n.x >> n.y >> n.z)) {
+        error = "node needs x y z";
+      }
+      nodes.push_back (n);
+      roleOf.push_back (0);
+
+    } else if (directive == "loop") {
+      ScenarioLoop l = ScenarioLoop ();
+      std::string model;
+      ss >> l.controller >> l.plant >> model >> l.reference >> l.kp >> l.ki >> l.kd;
+      if (!ss) {
+        error = "loop needs controller plant model reference kp ki kd";
+        break;
+      }
+      if (!(ss >> l.period)) {
+        l.period = 0;
+      }
+      if (!modelIndex.count (model)) {
+        error = "unknown model " + model;
+      } else if (l.controller >= nodes.size () || l.plant >= nodes.size () || l.controller == l.plant) {
+        error = "loop endpoints must be two nodes defined above";
+      } else if (roleOf[l.controller] || roleOf[l.plant]) {
+        error = "node already belongs to a loop";
+      } else if (l.period < 0) {
+        error = "bad loop period";
+      }
+      if (error.empty ()) {
+        l.model = modelIndex[model];
+        roleOf[l.controller] = roleOf[l.plant] = loops.size () + 1;
+        loops.push_back (l);
+      }
+
+    } else if (directive == "route") {
+      uint32_t ctrl = ~0u, hop;
+      std::vector<uint16_t> relays;
+      ss >> ctrl;
+      while (ss >> hop) {
+        if (hop >= nodes.size ()) {
+          error = "route through an unknown node";
+        }
+        relays.push_back (hop);
+      }
+      if (ctrl >= roleOf.size () || !roleOf[ctrl] || loops[roleOf[ctrl] - 1].controller != ctrl) {
+        error = "route must start at a loop's controller";
+      } else if (routes.count (ctrl)) {
+        error = "second route for the same loop";
+      }
+      routes[ctrl] = relays;
+
+    } else {
+      error = "unknown directive " + directive;
+    }
+  }
+  if (!error.empty ()) {
+    std::cerr << in << ":" << lineNo << ": " << error << std::endl;
+    return 1;
+  }
+  if (!routes.empty () && routes.size () != loops.size ()) {
+    std::cerr << in << ": routes must be given for every loop or none" << std::endl;
+    return 1;
+  }
+  if (nodes.size () > 0xfffe) {
+    std::cerr << in << ": more nodes than 16-bit short addresses" << std::endl;
+    return 1;
+  }
+
+  for (size_t i = 0; i < loops.size () && !routes.empty (); i++) {
+    const std::vector<uint16_t> &relays = routes[loops[i].controller];
+    loops[i].routeFirst = routeHops.size ();
+    loops[i].routeCount = relays.size () + 2;
+    routeHops.push_back (loops[i].controller);
+    routeHops.insert (routeHops.end (), relays.begin (), relays.end ());
+    routeHops.push_back (loops[i].plant);
+  }
+  header.nodes = nodes.size ();
+  header.models = models.size ();
+  header.loops = loops.size ();
+  header.routeHops = routeHops.size ();
+
+  std::ofstream bin (out.c_str (), std::ios::binary);
+  bin.write (reinterpret_cast<const char*>(&header), sizeof (header));
+  bin.write (reinterpret_cast<const char*>(nodes.data ()), nodes.size () * sizeof (ScenarioNode));
+  bin.write (reinterpret_cast<const char*>(models.data ()), models.size () * sizeof (ScenarioModel));
+  bin.write (reinterpret_cast<const char*>(loops.data ()), loops.size () * sizeof (ScenarioLoop));
+  bin.write (reinterpret_cast<const char*>(routeHops.data ()), routeHops.size () * sizeof (uint16_t));
+  if (!bin) {
+    std::cerr << "cannot write " << out << std::endl;
+    return 1;
+  }
+  std::cout << out << ": " << header.nodes << " nodes, " << header.models << " models, " << header.loops
+            << " loops" << (routes.empty () ? "" : ", fixed routes") << std::endl;
+  return 0;
+}
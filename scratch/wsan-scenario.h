@@ -0,0 +1,134 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Binary scenario format shared by wsan-scenario-compile (writer) and
+ * scratch-simulator --scenario (reader).
+ *
+ * A scenario file is one ScenarioHeader followed by the arrays
+ *
+ *   ScenarioNode  nodes[header.nodes]
+ *   ScenarioModel models[header.models]
+ *   ScenarioLoop  loops[header.loops]
+ *   uint16_t      routeHops[header.routeHops]
+ *
+ * in host byte order, each starting right after the previous one (all
+ * records are multiples of 8 bytes), so the simulator mmap()s the file and
+ * uses the arrays in place. The magic doubles as a byte-order check.
+ */
+#ifndef WSAN_SCENARIO_H
+#define WSAN_SCENARIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+const uint32_t SCENARIO_MAGIC     = 0x57534e53;  // "WSNS"
+const uint32_t SCENARIO_VERSION   = 1;
+const uint32_t SCENARIO_MAX_ORDER = 3;           // as PlantBank
+const uint32_t SCENARIO_BUILDING_TYPES = 3;      // Building::BuildingType_t values
+const uint32_t SCENARIO_WALL_TYPES     = 4;      // Building::ExtWallsType_t values
+
+struct ScenarioHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nodes;
+  uint32_t models;
+  uint32_t loops;
+  uint32_t routeHops;     // 0: no fixed routes, the simulator plans them
+  uint32_t roomsX;
+  uint32_t roomsY;
+  uint32_t floors;
+  uint32_t buildingType;  // Building::BuildingType_t
+  uint32_t wallsType;     // Building::ExtWallsType_t
+  uint32_t reserved;
+  double building[6];     // (m) xMin, xMax, yMin, yMax, zMin, zMax
+  double period;          // (s) control period of loops without their own
+};
+
+struct ScenarioNode {
+  double x, y, z;         // (m); the index is the node's short address
+};
+
+struct ScenarioModel {
+  uint32_t order;
+  uint32_t reserved;
+  double A[SCENARIO_MAX_ORDER * SCENARIO_MAX_ORDER];  // row-major order x order
+  double B[SCENARIO_MAX_ORDER];
+  double C[SCENARIO_MAX_ORDER];
+};
+
+struct ScenarioLoop {
+  uint32_t controller;
+  uint32_t plant;
+  uint32_t model;
+  uint32_t routeFirst;    // fixed route: routeHops[routeFirst..], controller to plant
+  uint32_t routeCount;
+  uint32_t reserved;
+  double period;          // (s) 0: header.period
+  double reference;
+  double kp, ki, kd;
+};
+
+static_assert (sizeof (ScenarioHeader) == 104, "ScenarioHeader layout");
+static_assert (sizeof (ScenarioNode) == 24, "ScenarioNode layout");
+static_assert (sizeof (ScenarioModel) == 128, "ScenarioModel layout");
+static_assert (sizeof (ScenarioLoop) == 64, "ScenarioLoop layout");
+
+inline size_t ScenarioFileSize (const ScenarioHeader &h) {
+  return sizeof (ScenarioHeader) + h.nodes * sizeof (ScenarioNode) + h.models * sizeof (ScenarioModel) +
+         h.loops * sizeof (ScenarioLoop) + h.routeHops * sizeof (uint16_t);
+}
+
+// Whether the size bytes at data (8-byte aligned) are a scenario of this
+// version that only indexes inside itself. The compiler checks all of this
+// too; a file from elsewhere must not index out of the reader's mapping.
+// maxNodes and maxOrder are the reader's limits.
+inline bool ScenarioValid (const void* data, size_t size, uint32_t maxNodes, uint32_t maxOrder) {
+  const ScenarioHeader* h = static_cast<const ScenarioHeader*>(data);
+  if (size < sizeof (ScenarioHeader) || h->magic != SCENARIO_MAGIC || h->version != SCENARIO_VERSION ||
+      ScenarioFileSize (*h) != size) {
+    return false;
+  }
+  if (h->nodes > maxNodes || !(h->period > 0) ||
+      h->buildingType >= SCENARIO_BUILDING_TYPES || h->wallsType >= SCENARIO_WALL_TYPES) {
+    return false;
+  }
+  const ScenarioNode* nodes = reinterpret_cast<const ScenarioNode*>(h + 1);
+  const ScenarioModel* models = reinterpret_cast<const ScenarioModel*>(nodes + h->nodes);
+  const ScenarioLoop* loops = reinterpret_cast<const ScenarioLoop*>(models + h->models);
+  const uint16_t* routeHops = reinterpret_cast<const uint16_t*>(loops + h->loops);
+  for (uint32_t m = 0; m < h->models; m++) {
+    if (models[m].order < 1 || models[m].order > maxOrder) {
+      return false;
+    }
+  }
+  for (uint32_t l = 0; l < h->loops; l++) {
+    const ScenarioLoop &loop = loops[l];
+    if (loop.controller >= h->nodes || loop.plant >= h->nodes || loop.model >= h->models ||
+        loop.routeFirst > h->routeHops || loop.routeCount > h->routeHops - loop.routeFirst ||
+        (h->routeHops > 0 && loop.routeCount < 2)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < loop.routeCount; i++) {
+      if (routeHops[loop.routeFirst + i] >= h->nodes) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+#endif /* WSAN_SCENARIO_H */
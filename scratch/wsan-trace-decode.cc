@@ -0,0 +1,98 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Convert a scratch-simulator binary trace (--traceFile) to CSV.
+ *
+ *   ./waf --run "wsan-trace-decode --in=trace.bin --out=trace.csv"
+ */
+#include <ns3/core-module.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "wsan-trace.h"
+
+using namespace ns3;
+
+int main (int argc, char *argv[])
+{
+  std::string in = "trace.bin";
+  std::string out = "";  // empty: stdout
+
+  CommandLine cmd;
+  cmd.AddValue ("in", "Binary trace written by scratch-simulator --traceFile", in);
+  cmd.AddValue ("out", "CSV output (empty: stdout)", out);
+  cmd.Parse (argc, argv);
+
+  int fd = open (in.c_str (), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "cannot open " << in << std::endl;
+    return 1;
+  }
+  struct stat st;
+  fstat (fd, &st);
+  if (static_cast<size_t>(st.st_size) < sizeof (TraceFileHeader)) {
+    std::cerr << in << ": too short for a trace header" << std::endl;
+    close (fd);
+    return 1;
+  }
+  void* map = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "cannot map " << in << std::endl;
+    return 1;
+  }
+
+  const TraceFileHeader* header = static_cast<const TraceFileHeader*>(map);
+  if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+      header->record_size != sizeof (TraceRecord)) {
+    std::cerr << in << ": not a version " << TRACE_VERSION << " trace (or wrong byte order)" << std::endl;
+    munmap (map, st.st_size);
+    return 1;
+  }
+
+  // a file cut short by a crash has no record_count: trust its size instead
+  uint64_t count = (st.st_size - sizeof (TraceFileHeader)) / sizeof (TraceRecord);
+  if (header->record_count != 0 && header->record_count < count) {
+    count = header->record_count;
+  }
+  const TraceRecord* records = reinterpret_cast<const TraceRecord*>(header + 1);
+
+  FILE* csv = out.empty () ? stdout : fopen (out.c_str (), "w");
+  if (!csv) {
+    std::cerr << "cannot write " << out << std::endl;
+    munmap (map, st.st_size);
+    return 1;
+  }
+  fprintf (csv, "time_s,node,event,dest,seq,payload\n");
+  for (uint64_t i = 0; i < count; i++) {
+    const TraceRecord &r = records[i];
+    fprintf (csv, "%.9f,%u,%s,%u,%u,%.17g\n", r.time * 1e-9, r.node, TraceEventName (r.event),
+             r.dsn >> 8, r.dsn & 0xff, r.payload);
+  }
+  if (csv != stdout) {
+    fclose (csv);
+  }
+  munmap (map, st.st_size);
+  return 0;
+}
@@ -0,0 +1,70 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Binary trace format shared by scratch-simulator (writer) and
+ * wsan-trace-decode (reader).
+ *
+ * A trace file is one TraceFileHeader followed by record_count fixed-size
+ * TraceRecords in host byte order, so the whole file can be mmap()ed and
+ * read as an array. The magic doubles as a byte-order check.
+ */
+#ifndef WSAN_TRACE_H
+#define WSAN_TRACE_H
+
+#include <stdint.h>
+
+const uint32_t TRACE_MAGIC   = 0x57534e54;  // "WSNT"
+const uint32_t TRACE_VERSION = 1;
+
+enum TraceEvent {
+  TRACE_TX                = 0,  // controller/plant sends a new sample
+  TRACE_RELAY             = 1,  // relay forwards a first-seen sample
+  TRACE_DISCARD_NOT_MINE  = 2,  // receiver is not on the source route
+  TRACE_DISCARD_DUPLICATE = 3,  // DSN already seen within the window
+  TRACE_DELIVER           = 4,  // controller/plant accepts a sample
+  TRACE_SUPPRESS          = 5,  // relay drops its pending forward, enough copies heard
+  TRACE_EVENT_COUNT
+};
+
+struct TraceFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t reserved;
+  uint64_t record_count;  // filled in when the writer closes the file
+};
+
+struct TraceRecord {
+  int64_t time;      // (ns) simulation time
+  uint32_t dsn;
+  uint16_t node;
+  uint8_t event;     // TraceEvent
+  uint8_t reserved;
+  double payload;
+};
+
+static_assert (sizeof (TraceFileHeader) == 24, "TraceFileHeader layout");
+static_assert (sizeof (TraceRecord) == 24, "TraceRecord layout");
+
+inline const char* TraceEventName (uint8_t event) {
+  static const char* names[TRACE_EVENT_COUNT] = {
+    "tx", "relay", "discard-not-mine", "discard-duplicate", "deliver", "suppress"
+  };
+  return event < TRACE_EVENT_COUNT ? names[event] : "unknown";
+}
+
+#endif /* WSAN_TRACE_H */
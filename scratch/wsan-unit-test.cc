@@ -0,0 +1,379 @@
+/* -*-  Mode: C++; c-file-style: "gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Unit checks for the parts of scratch-simulator that need no simulation
+ * run: the frame field encodings, the source route and the duplicate table
+ * (wsan-frame.h), and the scenario file validator (wsan-scenario.h). Prints
+ * every failed check and exits nonzero if there was one.
+ *
+ *   ./waf --run wsan-unit-test
+ */
+#include <ns3/buffer.h>
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "wsan-frame.h"
+#include "wsan-scenario.h"
+
+using namespace ns3;
+
+int checks = 0;
+int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    checks++; \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": failed: " << #cond << std::endl; \
+      failures++; \
+    } \
+  } while (0)
+
+// FRAME CODEC ====
+
+// writes the fields into a buffer of the codec's size and reads them back
+void RoundTrip (const FrameCodec &codec, uint16_t dest, uint8_t seq, double payload,
+                uint16_t &outDest, uint8_t &outSeq, double &outPayload) {
+  Buffer buffer;
+  buffer.AddAtStart (codec.GetSerializedSize ());
+  Buffer::Iterator it = buffer.Begin ();
+  codec.Write (it, dest, seq, payload);
+  CHECK (it.GetDistanceFrom (buffer.Begin ()) == codec.GetSerializedSize ());
+  it = buffer.Begin ();
+  codec.Read (it, outDest, outSeq, outPayload);
+  CHECK (it.GetDistanceFrom (buffer.Begin ()) == codec.GetSerializedSize ());
+}
+
+void TestFull () {
+  FrameCodec codec;
+  codec.AddLoop (0, 1, 0.01);
+  codec.Configure (FrameCodec::FULL, 8);
+  CHECK (codec.GetSerializedSize () == 11);
+  CHECK (codec.SeqMask () == 0xff);
+  const double values[] = {0, -0.0, 1e-300, -123.456789, 1e300};
+  for (double v : values) {
+    uint16_t dest;
+    uint8_t seq;
+    double p;
+    RoundTrip (codec, 0xfffd, 255, v, dest, seq, p);
+    CHECK (dest == 0xfffd && seq == 255);
+    CHECK (std::memcmp (&p, &v, sizeof (v)) == 0);
+  }
+}
+
+void TestFixed16 () {
+  FrameCodec codec;
+  const uint16_t ends[4] = {0, 1, 2, 22};
+  const double scales[2] = {0.01, 0.5};
+  codec.AddLoop (ends[0], ends[1], scales[0]);
+  codec.AddLoop (ends[2], ends[3], scales[1]);
+  codec.Configure (FrameCodec::FIXED16, 8);  // 1 loop bit, 1 direction bit, 6 sequence bits
+  CHECK (codec.GetSerializedSize () == 3);
+  CHECK (codec.SeqMask () == 0x3f);
+  const double values[] = {0, 0.004, 0.006, -1.234, 100.5, -163.84};
+  for (int e = 0; e < 4; e++) {
+    double scale = scales[e / 2];
+    for (double v : values) {
+      for (int s = 0; s < 256; s += 37) {
+        uint16_t dest;
+        uint8_t seq;
+        double p;
+        bool saturated;
+        RoundTrip (codec, ends[e], s, v, dest, seq, p);
+        CHECK (dest == ends[e]);
+        CHECK (seq == (s & 0x3f));
+        CHECK (p == codec.Quantize (ends[e], v, saturated));
+        CHECK (!saturated);
+        CHECK (std::fabs (p - v) <= scale / 2 * (1 + 1e-9));
+      }
+    }
+  }
+  bool saturated;
+  CHECK (codec.Quantize (0, 1000, saturated) == 32767 * 0.01 && saturated);
+  CHECK (codec.Quantize (1, -1000, saturated) == -32768 * 0.01 && saturated);
+  CHECK (codec.Quantize (5, 1000, saturated) == 1000 && !saturated);  // not a loop endpoint
+}
+
+void TestHalf16 () {
+  FrameCodec codec;
+  for (int l = 0; l < 100; l++) {
+    codec.AddLoop (2 * l, 2 * l + 1, 1);
+  }
+  codec.Configure (FrameCodec::HALF16, 12);  // 7 loop bits, 1 direction bit, 4 sequence bits
+  CHECK (codec.GetSerializedSize () == 4);
+  CHECK (codec.SeqMask () == 0xf);
+  bool saturated;
+  // exactly representable: normal, largest, smallest normal and subnormal
+  const double exact[] = {0, 1, -2.5, 65504, -65504, std::ldexp (1, -14), std::ldexp (1, -24), 1023 * std::ldexp (1, -24)};
+  for (double v : exact) {
+    CHECK (codec.Quantize (199, v, saturated) == v && !saturated);
+  }
+  // ties round to even, also among subnormals
+  CHECK (codec.Quantize (0, 2049, saturated) == 2048);
+  CHECK (codec.Quantize (0, 2051, saturated) == 2052);
+  CHECK (codec.Quantize (0, std::ldexp (1, -25), saturated) == 0);
+  CHECK (codec.Quantize (0, 3 * std::ldexp (1, -25), saturated) == std::ldexp (1, -23));
+  CHECK (codec.Quantize (0, 1e-9, saturated) == 0 && !saturated);
+  CHECK (codec.Quantize (0, 1e6, saturated) == 65504 && saturated);
+  CHECK (codec.Quantize (0, -65520, saturated) == -65504 && saturated);
+  // half an LSB at most: 11 significant bits
+  for (double v = 1e-4; v < 65000; v *= 1.37) {
+    for (int sign = -1; sign <= 1; sign += 2) {
+      double p = codec.Quantize (0, sign * v, saturated);
+      CHECK (std::fabs (p - sign * v) <= std::ldexp (std::fabs (v), -11));
+    }
+  }
+  for (int l = 0; l < 100; l += 33) {
+    for (int up = 0; up < 2; up++) {
+      uint16_t dest;
+      uint8_t seq;
+      double p;
+      RoundTrip (codec, 2 * l + up, 0x3b, -3.14159, dest, seq, p);
+      CHECK (dest == 2 * l + up);
+      CHECK (seq == 0xb);
+      CHECK (p == codec.Quantize (2 * l + up, -3.14159, saturated));
+    }
+  }
+}
+
+// SOURCE ROUTE ====
+
+std::vector<uint16_t> HopsOf (const SourceRoute &route) {
+  std::vector<uint16_t> hops;
+  route.AppendHops (hops);
+  return hops;
+}
+
+SourceRoute SerializeRoundTrip (const SourceRoute &route) {
+  Buffer buffer;
+  buffer.AddAtStart (route.GetSerializedSize ());
+  Buffer::Iterator it = buffer.Begin ();
+  route.Serialize (it);
+  CHECK (it.GetDistanceFrom (buffer.Begin ()) == route.GetSerializedSize ());
+  SourceRoute copy;
+  it = buffer.Begin ();
+  copy.Deserialize (it);
+  CHECK (copy.GetSerializedSize () == route.GetSerializedSize ());
+  return copy;
+}
+
+void TestSourceRoute () {
+  SourceRoute empty;
+  CHECK (empty.Empty () && empty.GetSerializedSize () == 1 && !empty.Contains (0));
+
+  // small indices: a bitmap, listed in index order
+  const uint16_t near[3] = {12, 3, 7};
+  SourceRoute bitmap;
+  bitmap.SetHops (near, 3);
+  CHECK (bitmap.GetSerializedSize () == 1 + 2);
+  CHECK (bitmap.Contains (3) && bitmap.Contains (7) && bitmap.Contains (12));
+  CHECK (!bitmap.Contains (4) && !bitmap.Contains (16) && !bitmap.Contains (600));
+  CHECK (HopsOf (bitmap) == std::vector<uint16_t> ({3, 7, 12}));
+  CHECK (HopsOf (SerializeRoundTrip (bitmap)) == HopsOf (bitmap));
+
+  // far apart: a hop list, in route order
+  const uint16_t far[3] = {1000, 5, 0xfffd};
+  SourceRoute list;
+  list.SetHops (far, 3);
+  CHECK (list.GetSerializedSize () == 1 + 6);
+  CHECK (list.Contains (1000) && list.Contains (5) && list.Contains (0xfffd));
+  CHECK (!list.Contains (4) && !list.Contains (1001));
+  CHECK (HopsOf (list) == std::vector<uint16_t> ({1000, 5, 0xfffd}));
+  SourceRoute copy = SerializeRoundTrip (list);
+  CHECK (HopsOf (copy) == HopsOf (list) && copy.Contains (0xfffd) && !copy.Contains (6));
+
+  // a corrupt length byte is clamped to the inline storage
+  Buffer buffer;
+  buffer.AddAtStart (1 + 127);
+  Buffer::Iterator it = buffer.Begin ();
+  it.WriteU8 (0x7f);
+  it = buffer.Begin ();
+  SourceRoute clamped;
+  clamped.Deserialize (it);
+  CHECK (clamped.GetSerializedSize () == 1 + SourceRoute::MAX_BYTES);
+}
+
+// DSN TABLE ====
+
+void TestDsnTable () {
+  DsnTable table;
+  CHECK (!table.Contains (5, 0) && table.Capacity () == 0);
+  table.Insert (5, 0, 100);
+  CHECK (table.Capacity () == DsnTable::MIN_SETS * DsnTable::WAYS);
+  CHECK (table.Contains (5, 0) && table.Contains (5, 99));
+  CHECK (!table.Contains (5, 100) && !table.Contains (6, 50));
+  table.Insert (5, 50, 100);  // seen again: the window restarts
+  CHECK (table.Contains (5, 149) && table.Size (60) == 1);
+  CHECK (table.Size (150) == 0);
+
+  // live entries survive a resize
+  DsnTable grown;
+  grown.Reserve (100, 0);
+  for (uint32_t dsn = 0; dsn < 100; dsn++) {
+    grown.Insert (dsn, 0, 1000 + dsn);
+  }
+  grown.Reserve (1000, 10);
+  CHECK (grown.Capacity () >= 4 * 1000);
+  CHECK (grown.Size (20) == 100);
+  bool all = true;
+  for (uint32_t dsn = 0; dsn < 100; dsn++) {
+    all = all && grown.Contains (dsn, 1000 + dsn - 1) && !grown.Contains (dsn, 1000 + dsn);
+  }
+  CHECK (all);
+  CHECK (grown.evictions == 0);
+
+  // at the planned load no entry is dropped, even for spread out DSNs
+  DsnTable planned;
+  planned.Reserve (500, 0);
+  for (uint32_t i = 0; i < 500; i++) {
+    planned.Insert (i * 65537u + (i >> 3), 0, 10);
+  }
+  CHECK (planned.evictions == 0 && planned.Size (0) == 500);
+
+  // beyond it, the entry expiring first makes room
+  DsnTable full;
+  for (uint32_t dsn = 0; dsn < 1000; dsn++) {
+    full.Insert (dsn, 0, 1 + dsn);
+  }
+  CHECK (full.evictions > 0);
+  CHECK (full.Size (0) == full.Capacity ());
+  CHECK (full.Contains (999, 0));
+
+  // snapshots
+  std::stringstream snapshot;
+  grown.Write (snapshot);
+  DsnTable restored;
+  CHECK (restored.Read (snapshot));
+  CHECK (restored.Capacity () == grown.Capacity () && restored.Size (20) == 100);
+  CHECK (restored.Contains (42, 1000) && !restored.Contains (100, 20));
+
+  std::stringstream corrupt;
+  uint32_t n = 64;
+  int32_t setBits = 30;
+  corrupt.write (reinterpret_cast<const char*>(&n), sizeof (n));
+  corrupt.write (reinterpret_cast<const char*>(&setBits), sizeof (setBits));
+  CHECK (!restored.Read (corrupt));
+  std::stringstream truncated (snapshot.str ().substr (0, 20));
+  CHECK (!restored.Read (truncated));
+}
+
+// SCENARIO VALIDATOR ====
+
+// Four nodes, one model, one loop from node 0 to node 3 over a fixed route
+// (or none), laid out as wsan-scenario-compile writes it.
+struct ScenarioImage {
+  std::vector<uint64_t> words;  // 8-byte aligned, as the mapping is
+  size_t size;
+
+  explicit ScenarioImage (bool routes = true) {
+    ScenarioHeader h;
+    std::memset (&h, 0, sizeof (h));
+    h.magic = SCENARIO_MAGIC;
+    h.version = SCENARIO_VERSION;
+    h.nodes = 4;
+    h.models = 1;
+    h.loops = 1;
+    h.routeHops = routes ? 3 : 0;
+    h.buildingType = SCENARIO_BUILDING_TYPES - 1;
+    h.wallsType = SCENARIO_WALL_TYPES - 1;
+    h.period = 0.1;
+    size = ScenarioFileSize (h);
+    words.assign ((size + 7) / 8, 0);
+    Header () = h;
+    Model ().order = 2;
+    Loop ().plant = 3;
+    Loop ().routeCount = h.routeHops;
+    if (routes) {
+      Hops ()[1] = 1;
+      Hops ()[2] = 3;
+    }
+  }
+
+  ScenarioHeader &Header () {
+    return *reinterpret_cast<ScenarioHeader*>(words.data ());
+  }
+
+  ScenarioModel &Model () {
+    return *reinterpret_cast<ScenarioModel*>(reinterpret_cast<ScenarioNode*>(&Header () + 1) + Header ().nodes);
+  }
+
+  ScenarioLoop &Loop () {
+    return *reinterpret_cast<ScenarioLoop*>(&Model () + Header ().models);
+  }
+
+  uint16_t* Hops () {
+    return reinterpret_cast<uint16_t*>(&Loop () + Header ().loops);
+  }
+
+  bool Valid (uint32_t maxNodes = 0xfffe) const {
+    return ScenarioValid (words.data (), size, maxNodes, SCENARIO_MAX_ORDER);
+  }
+};
+
+bool ValidAfter (void (*change) (ScenarioImage &s)) {
+  ScenarioImage s;
+  change (s);
+  return s.Valid ();
+}
+
+void TestScenarioValid () {
+  CHECK (ScenarioImage ().Valid ());
+  CHECK (ScenarioImage (false).Valid ());
+  CHECK (!ScenarioImage ().Valid (3));
+  CHECK (!ScenarioValid (ScenarioImage ().words.data (), sizeof (ScenarioHeader) - 8, 0xfffe, SCENARIO_MAX_ORDER));
+  CHECK (ValidAfter ([] (ScenarioImage &s) { s.Loop ().period = 0.05; }));
+
+  // header
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Header ().magic = __builtin_bswap32 (SCENARIO_MAGIC); }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Header ().version++; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.size -= 2; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Header ().routeHops = 2; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Header ().period = 0; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Header ().period = std::nan (""); }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Header ().buildingType = SCENARIO_BUILDING_TYPES; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Header ().wallsType = SCENARIO_WALL_TYPES; }));
+  // models
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Model ().order = 0; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Model ().order = SCENARIO_MAX_ORDER + 1; }));
+  // loops and routes
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Loop ().controller = 4; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Loop ().plant = 4; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Loop ().model = 1; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Loop ().routeCount = 4; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Loop ().routeCount = 1; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Loop ().routeFirst = 2; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Loop ().routeFirst = 0xffffffff; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Loop ().routeCount = 0xffffffff; }));
+  CHECK (!ValidAfter ([] (ScenarioImage &s) { s.Hops ()[1] = 4; }));
+}
+
+int main (int argc, char *argv[])
+{
+  TestFull ();
+  TestFixed16 ();
+  TestHalf16 ();
+  TestSourceRoute ();
+  TestDsnTable ();
+  TestScenarioValid ();
+
+  std::cout << checks << " checks, " << failures << " failed" << std::endl;
+  return failures > 0;
+}